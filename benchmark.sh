@@ -11,10 +11,14 @@ log_file_name=`date +"%s"`
 server_port=19875
 hca="mlx5_0"
 gid_idx=-1
+reuse="none"
+alloc="malloc"
+prefault="memset"
+extra_args=""
 
 help() {
     echo ""
-    echo "Usage: $0 -M MAX_SIZE -m MIN_SIZE -p MULT_INT -l LOOP_NUM -n LOG_FILE_NAME -I SERVER_IP -P SERVER_PORT -d IB_DEV -g GID_IDX [-s]"
+    echo "Usage: $0 -M MAX_SIZE -m MIN_SIZE -p MULT_INT -l LOOP_NUM -n LOG_FILE_NAME -I SERVER_IP -P SERVER_PORT -d IB_DEV -g GID_IDX -r REUSE -a ALLOC -f PREFAULT -x EXTRA_ARGS [-s]"
     echo "example-server: $0 -M $max_size -m $min_size -p $mult_int -l $loop_num -n $log_file_name -I 127.0.0.1 -P $server_port -d $hca -g $gid_idx -s"
     echo "example-client: $0 -M $max_size -m $min_size -p $mult_int -l $loop_num -n $log_file_name -I 127.0.0.1 -P $server_port -d $hca -g $gid_idx"
     echo "or all with default:"
@@ -26,7 +30,7 @@ help() {
 
 is_server=0
 
-while getopts "M:m:p:l:n:I:P:s?hd:g:" opt
+while getopts "M:m:p:l:n:I:P:s?hd:g:r:a:f:x:" opt
 do
     case "$opt" in
         M ) max_size=$OPTARG ;;
@@ -39,6 +43,10 @@ do
         s ) is_server=1 ;;
         d ) hca=$OPTARG ;;
         g ) gid_idx=$OPTARG ;;
+        r ) reuse=$OPTARG ;;
+        a ) alloc=$OPTARG ;;
+        f ) prefault=$OPTARG ;;
+        x ) extra_args="$OPTARG" ;;
         h|? ) help ;;
     esac
 done
@@ -60,10 +68,10 @@ for ((size = $min_size; size <= $max_size; size = $size * $mult_int))
 do
     if [ $is_server == 1 ]; then
         log_file="$dir/size-$size.txt"
-        ./rdma_perf_log -s $size -l $loop_num -p $server_port -d $hca -g $gid_idx > $log_file
+        ./rdma_perf_log -s $size -l $loop_num -p $server_port -d $hca -g $gid_idx -r $reuse -a $alloc -f $prefault $extra_args > $log_file
     else
         log_file="$dir/size-$size.txt"
-        ./rdma_perf_log -s $size -l $loop_num -p $server_port -d $hca -g $gid_idx $server_ip > $log_file
+        ./rdma_perf_log -s $size -l $loop_num -p $server_port -d $hca -g $gid_idx -r $reuse -a $alloc -f $prefault $extra_args $server_ip > $log_file
     fi
     server_port=$[$server_port+1]
 done
@@ -29,16 +29,115 @@ struct config_t config = {NULL,  /* dev_name */
                           NULL,  /* server_name */
                           19875, /* tcp_port */
                           1,     /* ib_port */
-                          -1 /* gid_idx */};
+                          -1,    /* gid_idx */
+                          RES_LEVEL_NONE, /* reuse */
+                          TEST_SETUP, /* test */
+                          0,      /* reg_cache */
+                          8,      /* reg_cache_ws */
+                          16,     /* qp_pool */
+                          ALLOC_MALLOC, /* alloc */
+                          PREFAULT_MEMSET, /* prefault */
+                          IBV_WR_SEND, /* opcode */
+                          1,      /* qdepth */
+                          1,      /* rd_atomic */
+                          64,     /* batch */
+                          1,      /* signal */
+                          16,     /* poll_batch */
+                          CQ_MODE_BUSY, /* cq_mode */
+                          20,     /* spin */
+                          0,      /* inline_size */
+                          1,      /* frags */
+                          0,      /* mtu, port active_mtu */
+                          0x12,   /* timeout */
+                          6,      /* retry_cnt */
+                          NULL,   /* output */
+                          1,      /* clients */
+                          1,      /* slots */
+                          0,      /* srq */
+                          IBV_QPT_RC, /* transport */
+                          CONN_DEFAULT, /* connect */
+                          1024,   /* qps */
+                          1,      /* threads */
+                          {0},    /* cpus */
+                          0,      /* num_cpus */
+                          NULL,   /* record */
+                          0       /* counters */};
 
+/* registration cache, in use when its pd is set */
+static struct reg_cache reg_cache;
+static struct sweep_spec sweep;
+
+
+/* time spent in buffer_alloc, split into allocation and prefault */
+static struct {
+  size_t count;      /* buffers allocated */
+  uint64_t alloc_ns; /* malloc/mmap/madvise time */
+  uint64_t touch_ns; /* memset prefault time */
+  uint64_t reg_ns;   /* ibv_reg_mr time of the setup loop */
+} buf_stats;
+
+static int sock_listen(int port) {
+  struct addrinfo *resolved_addr = NULL;
+  struct addrinfo *iterator;
+  char service[6];
+  int listenfd = -1;
+  int on = 1;
+  int rc;
+  struct addrinfo hints = {
+      .ai_flags = AI_PASSIVE, .ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+  if (sprintf(service, "%d", port) < 0)
+    return -1;
+  rc = getaddrinfo(NULL, service, &hints, &resolved_addr);
+  if (rc) {
+    PRINT_ERR("%s for port %d\n", gai_strerror(rc), port);
+    return -1;
+  }
+  for (iterator = resolved_addr; iterator && listenfd < 0;
+       iterator = iterator->ai_next) {
+    listenfd = socket(iterator->ai_family, iterator->ai_socktype,
+                      iterator->ai_protocol);
+    if (listenfd < 0)
+      continue;
+    /* connections accepted earlier on this port must not block the bind */
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (bind(listenfd, iterator->ai_addr, iterator->ai_addrlen) ||
+        listen(listenfd, SOMAXCONN)) {
+      close(listenfd);
+      listenfd = -1;
+    }
+  }
+  freeaddrinfo(resolved_addr);
+  if (listenfd < 0)
+    PRINT_ERR("failed to listen on port %d\n", port);
+  return listenfd;
+}
+/* the control messages are small and answered right away, Nagle would only
+ * hold them back */
+static void sock_nodelay(int sockfd) {
+  int on = 1;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+}
+static int sock_accept(int listenfd) {
+  int sockfd = accept(listenfd, NULL, 0);
+  if (sockfd >= 0)
+    sock_nodelay(sockfd);
+  return sockfd;
+}
 static int sock_connect(const char *servername, int port) {
   struct addrinfo *resolved_addr = NULL;
   struct addrinfo *iterator;
   char service[6];
   int sockfd = -1;
-  int listenfd = 0;
+  int listenfd = -1;
   struct addrinfo hints = {
       .ai_flags = AI_PASSIVE, .ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+  if (!servername) {
+    /* Server mode. Set up listening socket an accept a connection */
+    listenfd = sock_listen(port);
+    if (listenfd >= 0)
+      sockfd = sock_accept(listenfd);
+    goto sock_connect_exit;
+  }
   if (sprintf(service, "%d", port) < 0)
     goto sock_connect_exit;
   /* Resolve DNS address, use sockfd as temp storage */
@@ -52,27 +151,18 @@ static int sock_connect(const char *servername, int port) {
     sockfd = socket(iterator->ai_family, iterator->ai_socktype,
                     iterator->ai_protocol);
     if (sockfd >= 0) {
-      if (servername) {
-        /* Client mode. Initiate connection to remote */
-        while (connect(sockfd, iterator->ai_addr, iterator->ai_addrlen)) {
-          usleep(10 * 1000); // 10ms
-          //PRINT("failed connect \n");
-          //close(sockfd);
-          //sockfd = -1;
-        }
-      } else {
-        /* Server mode. Set up listening socket an accept a connection */
-        listenfd = sockfd;
-        sockfd = -1;
-        if (bind(listenfd, iterator->ai_addr, iterator->ai_addrlen))
-          goto sock_connect_exit;
-        listen(listenfd, 1);
-        sockfd = accept(listenfd, NULL, 0);
+      /* Client mode. Initiate connection to remote */
+      while (connect(sockfd, iterator->ai_addr, iterator->ai_addrlen)) {
+        usleep(10 * 1000); // 10ms
+        //PRINT("failed connect \n");
+        //close(sockfd);
+        //sockfd = -1;
       }
+      sock_nodelay(sockfd);
     }
   }
 sock_connect_exit:
-  if (listenfd)
+  if (listenfd >= 0)
     close(listenfd);
   if (resolved_addr)
     freeaddrinfo(resolved_addr);
@@ -87,66 +177,149 @@ sock_connect_exit:
   return sockfd;
 }
 
+/* one step of a full duplex transfer: waits until the socket can take or
+ * give data and moves as much as it can without blocking */
+static int sock_xfer_step(int sock, const char *out, size_t out_len,
+                          size_t *out_pos, char *in, size_t in_len,
+                          size_t *in_pos) {
+  struct pollfd pfd;
+  ssize_t n;
+  pfd.fd = sock;
+  pfd.events = (*out_pos < out_len ? POLLOUT : 0) |
+               (*in_pos < in_len ? POLLIN : 0);
+  pfd.revents = 0;
+  if (poll(&pfd, 1, -1) < 0)
+    return errno != EINTR;
+  if (pfd.revents & POLLOUT) {
+    n = send(sock, out + *out_pos, out_len - *out_pos,
+             MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n > 0)
+      *out_pos += n;
+    else if (!n || (errno != EAGAIN && errno != EINTR))
+      return 1;
+  }
+  if (*in_pos < in_len && (pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+    n = recv(sock, in + *in_pos, in_len - *in_pos, MSG_DONTWAIT);
+    if (n > 0)
+      *in_pos += n;
+    else if (!n || (errno != EAGAIN && errno != EINTR))
+      return 1;
+  }
+  return 0;
+}
 int sock_sync_data(int sock, int xfer_size, char *local_data,
                    char *remote_data) {
-  int rc;
-  int read_bytes = 0;
-  int total_read_bytes = 0;
-  rc = write(sock, local_data, xfer_size);
-  if (rc < xfer_size)
-    PRINT_ERR("Failed writing data during sock_sync_data\n");
-  else
-    rc = 0;
-  while (!rc && total_read_bytes < xfer_size) {
-    read_bytes = read(sock, remote_data, xfer_size);
-    if (read_bytes > 0)
-      total_read_bytes += read_bytes;
-    else
-      rc = read_bytes;
+  size_t out_pos = 0;
+  size_t in_pos = 0;
+  while (out_pos < (size_t)xfer_size || in_pos < (size_t)xfer_size) {
+    if (sock_xfer_step(sock, local_data, xfer_size, &out_pos, remote_data,
+                       xfer_size, &in_pos)) {
+      PRINT_ERR("Failed to transfer data during sock_sync_data\n");
+      return 1;
+    }
   }
-  return rc;
+  return 0;
+}
+static int sock_exchange(int sock, const void *local, uint32_t count,
+                         uint32_t rec_size, uint32_t max_count,
+                         void **remote, uint32_t *remote_count) {
+  struct batch_hdr hdr;
+  size_t out_len = sizeof hdr + (size_t)count * rec_size;
+  size_t out_pos = 0;
+  char *out = (char *)malloc(out_len);
+  char *in = (char *)&hdr;
+  size_t in_len = sizeof hdr;
+  size_t in_pos = 0;
+  int have_hdr = 0;
+
+  *remote = NULL;
+  if (!out) {
+    PRINT_ERR("failed to allocate %zu bytes for sock_exchange\n", out_len);
+    return 1;
+  }
+  hdr.count = htonl(count);
+  hdr.rec_size = htonl(rec_size);
+  memcpy(out, &hdr, sizeof hdr);
+  memcpy(out + sizeof hdr, local, (size_t)count * rec_size);
+  while (out_pos < out_len || in_pos < in_len) {
+    if (sock_xfer_step(sock, out, out_len, &out_pos, in, in_len, &in_pos)) {
+      PRINT_ERR("Failed to transfer data during sock_exchange\n");
+      goto sock_exchange_err;
+    }
+    /* the records follow the header into a buffer of the announced size */
+    if (!have_hdr && in_pos == in_len) {
+      have_hdr = 1;
+      if (ntohl(hdr.rec_size) != rec_size) {
+        PRINT_ERR("peer sends records of %u bytes, not %u\n",
+                  ntohl(hdr.rec_size), rec_size);
+        goto sock_exchange_err;
+      }
+      *remote_count = ntohl(hdr.count);
+      if (*remote_count > max_count) {
+        PRINT_ERR("peer announces %u records, at most %u expected\n",
+                  *remote_count, max_count);
+        goto sock_exchange_err;
+      }
+      in_len = (size_t)*remote_count * rec_size;
+      in_pos = 0;
+      in = (char *)malloc(in_len ? in_len : 1);
+      if (!in)
+        goto sock_exchange_err;
+      *remote = in;
+    }
+  }
+  free(out);
+  return 0;
+
+sock_exchange_err:
+  free(out);
+  free(*remote);
+  *remote = NULL;
+  return 1;
 }
 
+/* room for the GRH in front of every UD receive */
+static size_t ud_grh(void) {
+  return config.transport == IBV_QPT_UD ? UD_GRH_SIZE : 0;
+}
+/* a UD send names its destination in every WR */
+static void ud_dest(const struct resources *res, struct ibv_send_wr *wr) {
+  wr->wr.ud.ah = res->ah;
+  wr->wr.ud.remote_qpn = res->remote_props.qp_num;
+  wr->wr.ud.remote_qkey = UD_QKEY;
+}
+/* inline sends are copied by the CPU at post time, the HCA never reads the
+ * source buffer, which therefore needs no registration */
+static int use_inline(const struct resources *res, int opcode, size_t size) {
+  return opcode != IBV_WR_RDMA_READ && size && size <= res->max_inline;
+}
+/* source of size bytes sent with opcode, registered is the buffer used when
+ * the send is not inlined */
+static char *send_src(const struct resources *res, int opcode, size_t size,
+                      char *registered) {
+  if (res->inline_buf && use_inline(res, opcode, size))
+    return res->inline_buf;
+  return registered;
+}
 static int poll_completion(struct resources *res) {
-  struct ibv_wc wc;
-  unsigned long start_time_msec;
-  unsigned long cur_time_msec;
-  struct timeval cur_time;
+  struct cq_poller poller;
   int poll_result;
   int rc = 0;
 
+  if (cq_poller_init(&poller, res, 1))
+    return 1;
   /* poll the completion for a while before giving up of doing it .. */
-  gettimeofday(&cur_time, NULL);
-  start_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-  size_t t0 = get_timestamp();
-  do {
-    poll_result = ibv_poll_cq(res->cq, 1, &wc);
-
-    gettimeofday(&cur_time, NULL);
-    cur_time_msec = (cur_time.tv_sec * 1000) + (cur_time.tv_usec / 1000);
-  } while ((poll_result == 0) &&
-           ((cur_time_msec - start_time_msec) < MAX_POLL_CQ_TIMEOUT));
-  size_t t1 = get_timestamp();
-  PRINT_TIME("ibv_poll_cq", t1 - t0);
+  LOG_TIME(poll_result = cq_poller_poll(&poller), "ibv_poll_cq");
 
   if (poll_result < 0) {
-    /* poll CQ failed */
-    PRINT_ERR("poll CQ failed\n");
-    rc = 1;
-  } else if (poll_result == 0) { /* the CQ is empty */
-    PRINT_ERR("completion wasn't found in the CQ after timeout\n");
+    /* poll CQ failed, timed out or returned a bad completion */
     rc = 1;
   } else {
     /* CQE found */
-    PRINT("completion was found in CQ with status 0x%x\n", wc.status);
-    /* check the completion status (here we don't care about the completion
-     * opcode */
-    if (wc.status != IBV_WC_SUCCESS) {
-      PRINT_ERR("got bad completion with status: 0x%x, vendor syndrome: 0x%x\n",
-                wc.status, wc.vendor_err);
-      rc = 1;
-    }
+    PRINT("completion was found in CQ with status 0x%x\n",
+          poller.wc[0].status);
   }
+  cq_poller_destroy(&poller);
   return rc;
 }
 
@@ -168,6 +341,8 @@ static int post_send(struct resources *res, int opcode) {
   sr.num_sge = 1;
   sr.opcode = opcode;
   sr.send_flags = IBV_SEND_SIGNALED;
+  if (use_inline(res, opcode, MSG_SIZE))
+    sr.send_flags |= IBV_SEND_INLINE;
   if (opcode != IBV_WR_SEND) {
     sr.wr.rdma.remote_addr = res->remote_props.addr;
     sr.wr.rdma.rkey = res->remote_props.rkey;
@@ -220,6 +395,7 @@ static int post_receive(struct resources *res) {
 static void resources_init(struct resources *res) {
   memset(res, 0, sizeof *res);
   res->sock = -1;
+  res->epfd = -1;
 }
 static int sock_create(struct resources *res) {
   int rc = 0;
@@ -252,14 +428,282 @@ sock_create_exit:
   }
   return rc;
 }
-static int resources_create(struct resources *res) {
+/* names of enum buf_alloc and enum buf_prefault, as accepted by -a and -f */
+static const char *const alloc_names[ALLOC_NUM] = {
+    [ALLOC_MALLOC] = "malloc", [ALLOC_MMAP] = "mmap",
+    [ALLOC_HUGE_2M] = "huge2m", [ALLOC_HUGE_1G] = "huge1g",
+    [ALLOC_THP] = "thp"};
+static const char *const prefault_names[PREFAULT_NUM] = {
+    [PREFAULT_NONE] = "none", [PREFAULT_MEMSET] = "memset",
+    [PREFAULT_POPULATE] = "populate"};
+
+/* data path opcodes accepted by -o, indexed by IBV_WR_* */
+static const char *const opcode_names[IBV_WR_ATOMIC_FETCH_AND_ADD + 1] = {
+    [IBV_WR_RDMA_WRITE] = "write", [IBV_WR_SEND] = "send",
+    [IBV_WR_RDMA_READ] = "read", [IBV_WR_ATOMIC_FETCH_AND_ADD] = "fadd",
+    [IBV_WR_ATOMIC_CMP_AND_SWP] = "cas"};
+
+static int is_atomic(int opcode) {
+  return opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+         opcode == IBV_WR_ATOMIC_CMP_AND_SWP;
+}
+/* access granted to MRs and QPs, atomics only where the test needs them */
+static int access_flags(void) {
+  int flags =
+      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+  if (config.test == TEST_ATOMIC)
+    flags |= IBV_ACCESS_REMOTE_ATOMIC;
+  return flags;
+}
+
+/* names of enum cq_mode, as accepted by -C */
+static const char *const cq_mode_names[CQ_MODE_NUM] = {
+    [CQ_MODE_BUSY] = "busy", [CQ_MODE_EVENT] = "event",
+    [CQ_MODE_HYBRID] = "hybrid"};
+
+/* bytes of an enum ibv_mtu and back, 0 if bytes is no valid MTU */
+static int mtu_bytes(int mtu) { return 128 << mtu; }
+static int parse_mtu(const char *arg) {
+  int mtu;
+  for (mtu = IBV_MTU_256; mtu <= IBV_MTU_4096; ++mtu) {
+    if (mtu_bytes(mtu) == atoi(arg))
+      return mtu;
+  }
+  return 0;
+}
+
+static int parse_name(const char *name, const char *const names[], int num) {
+  int i;
+  for (i = 0; i < num; ++i) {
+    if (names[i] && !strcmp(name, names[i]))
+      return i;
+  }
+  return -1;
+}
+
+/* length of the mapping backing a buffer of size bytes */
+static size_t buffer_map_length(size_t size) {
+  size_t page;
+  switch (config.alloc) {
+  case ALLOC_HUGE_2M:
+  case ALLOC_THP:
+    page = HUGE_2M;
+    break;
+  case ALLOC_HUGE_1G:
+    page = HUGE_1G;
+    break;
+  default:
+    page = sysconf(_SC_PAGESIZE);
+    break;
+  }
+  return (size + page - 1) / page * page;
+}
+static char *buffer_alloc(size_t size) {
+  size_t length = buffer_map_length(size);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  char *buf = NULL;
+
+  if (config.prefault == PREFAULT_POPULATE)
+    flags |= MAP_POPULATE;
+  switch (config.alloc) {
+  case ALLOC_MALLOC:
+    LOG_TIME_ADD(buf = (char *)malloc(size), "buf_alloc", buf_stats.alloc_ns);
+    break;
+  case ALLOC_MMAP:
+    LOG_TIME_ADD(buf = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1,
+                            0),
+                 "buf_alloc", buf_stats.alloc_ns);
+    break;
+  case ALLOC_HUGE_2M:
+    LOG_TIME_ADD(buf = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                            flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0),
+                 "buf_alloc", buf_stats.alloc_ns);
+    break;
+  case ALLOC_HUGE_1G:
+    LOG_TIME_ADD(buf = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                            flags | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0),
+                 "buf_alloc", buf_stats.alloc_ns);
+    break;
+  case ALLOC_THP:
+    LOG_TIME_ADD(buf = buffer_alloc_thp(length), "buf_alloc",
+                 buf_stats.alloc_ns);
+    break;
+  }
+  if (buf == MAP_FAILED)
+    buf = NULL;
+  if (!buf) {
+    PRINT_ERR("failed to %s %zu bytes to memory buffer%s\n",
+              alloc_names[config.alloc], length,
+              config.alloc == ALLOC_HUGE_2M || config.alloc == ALLOC_HUGE_1G
+                  ? ", are hugepages reserved in /proc/sys/vm/nr_hugepages?"
+                  : "");
+    return NULL;
+  }
+  /* fault in (and zero) every page now instead of during ibv_reg_mr */
+  if (config.prefault == PREFAULT_MEMSET)
+    LOG_TIME_ADD(memset(buf, 0, size), "buf_touch", buf_stats.touch_ns);
+  __atomic_fetch_add(&buf_stats.count, 1, __ATOMIC_RELAXED);
+  return buf;
+}
+/* transparent hugepages need a 2MB aligned range, map one huge page more
+ * than needed and trim the unaligned head and tail */
+static char *buffer_alloc_thp(size_t length) {
+  size_t extra = HUGE_2M;
+  char *map = mmap(NULL, length + extra, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *buf;
+  size_t head;
+  if (map == MAP_FAILED)
+    return NULL;
+  buf = (char *)(((uintptr_t)map + HUGE_2M - 1) & ~(uintptr_t)(HUGE_2M - 1));
+  head = buf - map;
+  if (head)
+    munmap(map, head);
+  if (extra - head)
+    munmap(buf + length, extra - head);
+  if (madvise(buf, length, MADV_HUGEPAGE))
+    PRINT_ERR("madvise(MADV_HUGEPAGE) failed, THP may be disabled\n");
+  /* MAP_POPULATE would fault in small pages before the madvise */
+  if (config.prefault == PREFAULT_POPULATE) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(buf, length, MADV_POPULATE_WRITE))
+#endif
+      memset(buf, 0, length);
+  }
+  return buf;
+}
+static void buffer_free(char *buf, size_t size) {
+  /* registrations must not outlive the memory they pin */
+  if (reg_cache.pd)
+    reg_cache_invalidate(&reg_cache, buf, size);
+  if (config.alloc == ALLOC_MALLOC)
+    free(buf);
+  else
+    munmap(buf, buffer_map_length(size));
+}
+
+static void reg_cache_init(struct reg_cache *cache, struct ibv_pd *pd,
+                           size_t budget) {
+  memset(cache, 0, sizeof *cache);
+  cache->pd = pd;
+  cache->budget = budget;
+}
+static void reg_cache_unlink(struct reg_cache *cache,
+                             struct reg_cache_entry *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    cache->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    cache->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+static void reg_cache_push(struct reg_cache *cache,
+                           struct reg_cache_entry *e) {
+  e->prev = NULL;
+  e->next = cache->head;
+  if (cache->head)
+    cache->head->prev = e;
+  else
+    cache->tail = e;
+  cache->head = e;
+}
+static void reg_cache_remove(struct reg_cache *cache,
+                             struct reg_cache_entry *e) {
+  reg_cache_unlink(cache, e);
+  RDMA_CHECK(0 == ibv_dereg_mr(e->mr), "failed to deregister cached MR");
+  cache->pinned -= e->length;
+  free(e);
+}
+/* evict idle entries, least recently used first, until length more bytes fit
+ * in the budget */
+static void reg_cache_evict(struct reg_cache *cache, size_t length) {
+  struct reg_cache_entry *e = cache->tail;
+  while (e && cache->pinned + length > cache->budget) {
+    struct reg_cache_entry *prev = e->prev;
+    if (!e->refcnt) {
+      reg_cache_remove(cache, e);
+      cache->evictions++;
+    }
+    e = prev;
+  }
+}
+static struct ibv_mr *reg_cache_get(struct reg_cache *cache, char *addr,
+                                    size_t length) {
+  struct reg_cache_entry *e;
+  int mr_flags = access_flags();
+  uint64_t t0 = get_time_ns();
+  for (e = cache->head; e; e = e->next) {
+    if (e->addr <= addr && addr + length <= e->addr + e->length)
+      break;
+  }
+  if (e) {
+    /* hit, move to the front of the LRU list */
+    reg_cache_unlink(cache, e);
+    reg_cache_push(cache, e);
+    e->refcnt++;
+    cache->hits++;
+    cache->hit_ns += get_time_ns() - t0;
+    return e->mr;
+  }
+  /* miss, make room and register the range */
+  reg_cache_evict(cache, length);
+  e = (struct reg_cache_entry *)calloc(1, sizeof *e);
+  if (!e) {
+    PRINT_ERR("failed to allocate registration cache entry\n");
+    return NULL;
+  }
+  e->mr = ibv_reg_mr(cache->pd, addr, length, mr_flags);
+  if (!e->mr) {
+    PRINT_ERR("ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
+    free(e);
+    return NULL;
+  }
+  e->addr = addr;
+  e->length = length;
+  e->refcnt = 1;
+  reg_cache_push(cache, e);
+  cache->pinned += length;
+  cache->misses++;
+  cache->miss_ns += get_time_ns() - t0;
+  return e->mr;
+}
+static void reg_cache_put(struct reg_cache *cache, struct ibv_mr *mr) {
+  struct reg_cache_entry *e;
+  for (e = cache->head; e; e = e->next) {
+    if (e->mr == mr) {
+      e->refcnt--;
+      break;
+    }
+  }
+  /* an entry bigger than the budget is only kept while it is in use */
+  reg_cache_evict(cache, 0);
+}
+static void reg_cache_invalidate(struct reg_cache *cache, char *addr,
+                                 size_t length) {
+  struct reg_cache_entry *e = cache->head;
+  while (e) {
+    struct reg_cache_entry *next = e->next;
+    if (e->addr < addr + length && addr < e->addr + e->length) {
+      RDMA_CHECK(0 == e->refcnt, "freeing buffer %p while its MR is in use",
+                 addr);
+      reg_cache_remove(cache, e);
+      cache->invalidations++;
+    }
+    e = next;
+  }
+}
+static void reg_cache_flush(struct reg_cache *cache) {
+  while (cache->head)
+    reg_cache_remove(cache, cache->head);
+}
+
+static int resources_create_device(struct resources *res) {
   struct ibv_device **dev_list = NULL;
-  struct ibv_qp_init_attr qp_init_attr;
   struct ibv_device *ib_dev = NULL;
-  size_t size;
   int i;
-  int mr_flags = 0;
-  int cq_size = 0;
   int num_devices;
   int rc = 0;
 
@@ -270,13 +714,13 @@ static int resources_create(struct resources *res) {
 
   if (!dev_list) {
     rc = 1;
-    goto resources_create_exit;
+    goto resources_create_device_exit;
   }
   /* if there isn't any IB device in host */
   if (!num_devices) {
     PRINT_ERR("found %d device(s)\n", num_devices);
     rc = 1;
-    goto resources_create_exit;
+    goto resources_create_device_exit;
   }
   PRINT("found %d device(s)\n", num_devices);
   /* search for the specific device we want to work with */
@@ -295,7 +739,7 @@ static int resources_create(struct resources *res) {
   if (!ib_dev) {
     PRINT_ERR("IB device %s wasn't found\n", config.dev_name);
     rc = 1;
-    goto resources_create_exit;
+    goto resources_create_device_exit;
   }
   /* get device handle */
   LOG_TIME(res->ib_ctx = ibv_open_device(ib_dev), "ibv_open_device");
@@ -303,46 +747,141 @@ static int resources_create(struct resources *res) {
   if (!res->ib_ctx) {
     PRINT_ERR("failed to open device %s\n", config.dev_name);
     rc = 1;
-    goto resources_create_exit;
+    goto resources_create_device_exit;
+  }
+  /* query device limits and port properties */
+  if (ibv_query_device(res->ib_ctx, &res->device_attr)) {
+    PRINT_ERR("ibv_query_device failed\n");
+    ibv_close_device(res->ib_ctx);
+    res->ib_ctx = NULL;
+    rc = 1;
+    goto resources_create_device_exit;
   }
-  /* We are now done with device list, free it */
-  ibv_free_device_list(dev_list);
-  dev_list = NULL;
-  ib_dev = NULL;
-  /* query port properties */
   if (ibv_query_port(res->ib_ctx, config.ib_port, &res->port_attr)) {
     PRINT_ERR("ibv_query_port on port %u failed\n", config.ib_port);
+    ibv_close_device(res->ib_ctx);
+    res->ib_ctx = NULL;
+    rc = 1;
+    goto resources_create_device_exit;
+  }
+  /* the path MTU defaults to, and may not exceed, what the port runs at */
+  if (!config.mtu)
+    config.mtu = res->port_attr.active_mtu;
+  if (config.mtu > (int)res->port_attr.active_mtu) {
+    PRINT_ERR("MTU %d exceeds the active MTU %d of port %u\n",
+              mtu_bytes(config.mtu), mtu_bytes(res->port_attr.active_mtu),
+              config.ib_port);
+    ibv_close_device(res->ib_ctx);
+    res->ib_ctx = NULL;
     rc = 1;
-    goto resources_create_exit;
+    goto resources_create_device_exit;
   }
+resources_create_device_exit:
+  /* We are now done with device list, free it */
+  if (dev_list)
+    ibv_free_device_list(dev_list);
+  return rc;
+}
+static int resources_create_pd(struct resources *res) {
   /* allocate Protection Domain */
   LOG_TIME(res->pd = ibv_alloc_pd(res->ib_ctx), "ibv_alloc_pd");
 
   if (!res->pd) {
     PRINT_ERR("ibv_alloc_pd failed\n");
-    rc = 1;
-    goto resources_create_exit;
+    return 1;
+  }
+  return 0;
+}
+/* completion channel plus an epoll instance watching its fd */
+static int create_comp_channel(struct resources *res) {
+  struct epoll_event ev;
+  int flags;
+  LOG_TIME(res->channel = ibv_create_comp_channel(res->ib_ctx),
+           "ibv_create_comp_channel");
+  if (!res->channel) {
+    PRINT_ERR("ibv_create_comp_channel failed\n");
+    return 1;
+  }
+  /* never block in ibv_get_cq_event, epoll_wait does the sleeping */
+  flags = fcntl(res->channel->fd, F_GETFL);
+  if (flags < 0 || fcntl(res->channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    PRINT_ERR("failed to make the completion channel non-blocking\n");
+    return 1;
+  }
+  res->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (res->epfd < 0) {
+    PRINT_ERR("epoll_create1 failed\n");
+    return 1;
+  }
+  memset(&ev, 0, sizeof ev);
+  ev.events = EPOLLIN;
+  if (epoll_ctl(res->epfd, EPOLL_CTL_ADD, res->channel->fd, &ev)) {
+    PRINT_ERR("failed to add the completion channel to epoll\n");
+    return 1;
+  }
+  return 0;
+}
+static void destroy_comp_channel(struct resources *res) {
+  if (res->epfd >= 0)
+    close(res->epfd);
+  res->epfd = -1;
+  if (res->channel)
+    LOG_TIME(ibv_destroy_comp_channel(res->channel),
+             "ibv_destroy_comp_channel");
+  res->channel = NULL;
+}
+static int resources_create_cq(struct resources *res) {
+  int cq_size = 0;
+  /* each side has at most qdepth sends and qdepth receives outstanding (one
+   * WR in the setup test) per client, size the Completion Queue for both */
+  cq_size = 2 * config.qdepth * config.clients;
+  if (cq_size > res->device_attr.max_cqe)
+    cq_size = res->device_attr.max_cqe;
+  /* the cqmode test switches modes on the same CQ */
+  if (config.cq_mode != CQ_MODE_BUSY || config.test == TEST_CQMODE) {
+    if (create_comp_channel(res)) {
+      destroy_comp_channel(res);
+      return 1;
+    }
   }
-  /* each side will send only one WR, so Completion Queue with 1 entry is enough
-   */
-  cq_size = 1;
-  LOG_TIME(res->cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, NULL, 0),
+  LOG_TIME(res->cq = ibv_create_cq(res->ib_ctx, cq_size, NULL, res->channel,
+                                   0),
            "ibv_create_cq");
   if (!res->cq) {
     PRINT_ERR("failed to create CQ with %u entries\n", cq_size);
-    rc = 1;
-    goto resources_create_exit;
+    destroy_comp_channel(res);
+    return 1;
   }
+  return 0;
+}
+static int resources_create_mr(struct resources *res) {
+  size_t size;
+  int mr_flags = 0;
   /* allocate the memory buffer that will hold the data */
-  size = MSG_SIZE;
-  res->buf = (char *)malloc(size);
+  if (!res->buf_size)
+    res->buf_size = MSG_SIZE;
+  size = res->buf_size + ud_grh();
   PRINT("MSG_SIZE: %zu\n", MSG_SIZE);
-  if (!res->buf) {
-    PRINT_ERR("failed to malloc %Zu bytes to memory buffer\n", size);
-    rc = 1;
-    goto resources_create_exit;
+  if (config.reg_cache) {
+    /* the cache lives as long as the PD it registers with, its counters
+     * accumulate over all PDs */
+    if (reg_cache.pd != res->pd) {
+      reg_cache.pd = res->pd;
+      reg_cache.budget = config.reg_cache;
+    }
+    /* like an application reusing its buffers, the buffer outlives the MR and
+     * is only freed together with the PD */
+    if (!res->buf)
+      res->buf = buffer_alloc(size);
+    if (!res->buf)
+      return 1;
+    LOG_TIME(res->mr = reg_cache_get(&reg_cache, res->buf, size),
+             "ibv_reg_mr");
+    return res->mr == NULL;
   }
-  memset(res->buf, 0, size);
+  res->buf = buffer_alloc(size);
+  if (!res->buf)
+    return 1;
   /* only in the server side put the message in the memory buffer */
   // if (!config.server_name) {
   //  strcpy(res->buf, MSG);
@@ -350,67 +889,422 @@ static int resources_create(struct resources *res) {
   //}
 
   /* register the memory buffer */
-  mr_flags =
-      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-  LOG_TIME(res->mr = ibv_reg_mr(res->pd, res->buf, size, mr_flags),
-           "ibv_reg_mr");
+  mr_flags = access_flags();
+  LOG_TIME_ADD(res->mr = ibv_reg_mr(res->pd, res->buf, size, mr_flags),
+               "ibv_reg_mr", buf_stats.reg_ns);
 
   if (!res->mr) {
     PRINT_ERR("ibv_reg_mr failed with mr_flags=0x%x\n", mr_flags);
-    rc = 1;
-    goto resources_create_exit;
+    buffer_free(res->buf, size);
+    res->buf = NULL;
+    return 1;
   }
   PRINT("MR was registered with addr=%p, lkey=0x%x, rkey=0x%x, flags=0x%x\n",
         res->buf, res->mr->lkey, res->mr->rkey, mr_flags);
+  return 0;
+}
+/* largest max_inline_data the device accepts for QPs like attr, found once
+ * by bisection with throwaway QPs since devices do not advertise it */
+static uint32_t probe_max_inline(struct resources *res,
+                                 const struct ibv_qp_init_attr *attr) {
+  static int64_t probed = -1;
+  struct ibv_qp_init_attr probe;
+  struct ibv_qp *qp;
+  uint32_t lo = 0;
+  uint32_t hi = INLINE_PROBE_MAX + 1;
+  if (probed >= 0)
+    return probed;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    probe = *attr;
+    probe.cap.max_inline_data = mid;
+    qp = ibv_create_qp(res->pd, &probe);
+    if (qp) {
+      ibv_destroy_qp(qp);
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  probed = lo;
+  PRINT("device accepts up to %u bytes of inline data\n", lo);
+  return lo;
+}
+/* QP attributes of the tests, shared by ibv_create_qp and rdma_create_qp */
+static int fill_qp_init_attr(struct resources *res,
+                             struct ibv_qp_init_attr *attr) {
+  memset(attr, 0, sizeof *attr);
+  /* a UD message has to fit into a single packet */
+  if (config.transport == IBV_QPT_UD && MSG_SIZE > (size_t)mtu_bytes(config.mtu)) {
+    PRINT_ERR("UD messages are limited to the MTU of %d bytes\n",
+              mtu_bytes(config.mtu));
+    return 1;
+  }
+  /* the tests keep up to qdepth WRs posted, a smaller queue would overflow */
+  if (config.qdepth > res->device_attr.max_qp_wr) {
+    PRINT_ERR("queue depth %d exceeds the device limit of %d WRs\n",
+              config.qdepth, res->device_attr.max_qp_wr);
+    return 1;
+  }
+  attr->qp_type = config.transport;
+  /* with selective signaling only the WRs asking for it get a CQE */
+  attr->sq_sig_all = config.signal == 1 && config.test != TEST_SIG;
+  attr->send_cq = res->cq;
+  attr->recv_cq = res->cq;
+  attr->srq = res->srq;
+  attr->cap.max_send_wr = config.qdepth;
+  attr->cap.max_recv_wr = config.qdepth;
+  /* scattered sends gather from up to config.frags fragments */
+  attr->cap.max_send_sge = config.frags;
+  if (attr->cap.max_send_sge > (uint32_t)res->device_attr.max_sge)
+    attr->cap.max_send_sge = res->device_attr.max_sge;
+  attr->cap.max_recv_sge = 1;
+  if (config.inline_size < 0)
+    attr->cap.max_inline_data = probe_max_inline(res, attr);
+  else
+    attr->cap.max_inline_data = config.inline_size;
+  return 0;
+}
+static struct ibv_qp *create_qp(struct resources *res) {
+  struct ibv_qp_init_attr qp_init_attr;
+  struct ibv_qp *qp;
   /* create the Queue Pair */
-  memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-  qp_init_attr.qp_type = IBV_QPT_RC;
-  qp_init_attr.sq_sig_all = 1;
-  qp_init_attr.send_cq = res->cq;
-  qp_init_attr.recv_cq = res->cq;
-  qp_init_attr.cap.max_send_wr = 1;
-  qp_init_attr.cap.max_recv_wr = 1;
-  qp_init_attr.cap.max_send_sge = 1;
-  qp_init_attr.cap.max_recv_sge = 1;
-
-  LOG_TIME(res->qp = ibv_create_qp(res->pd, &qp_init_attr), "ibv_create_qp");
-
-  if (!res->qp) {
+  if (fill_qp_init_attr(res, &qp_init_attr))
+    return NULL;
+
+  LOG_TIME(qp = ibv_create_qp(res->pd, &qp_init_attr), "ibv_create_qp");
+
+  if (!qp) {
     PRINT_ERR("failed to create QP\n");
-    rc = 1;
-    goto resources_create_exit;
+    return NULL;
   }
-  PRINT("QP was created, QP number=0x%x\n", res->qp->qp_num);
-resources_create_exit:
-  if (rc) {
-    /* Error encountered, cleanup */
-    if (res->qp) {
-      ibv_destroy_qp(res->qp);
-      res->qp = NULL;
-    }
-    if (res->mr) {
-      ibv_dereg_mr(res->mr);
-      res->mr = NULL;
-    }
-    if (res->buf) {
-      free(res->buf);
-      res->buf = NULL;
-    }
-    if (res->cq) {
-      ibv_destroy_cq(res->cq);
-      res->cq = NULL;
+  record_qp = qp->qp_num;
+  /* the provider reports what it actually granted, possibly more, only
+   * inline when asked to and never beyond -I */
+  res->max_inline = qp_init_attr.cap.max_inline_data;
+  if (config.inline_size >= 0 && (uint32_t)config.inline_size < res->max_inline)
+    res->max_inline = config.inline_size;
+  res->max_send_sge = qp_init_attr.cap.max_send_sge;
+  return qp;
+}
+static int resources_create_qp(struct resources *res) {
+  /* the server's QPs receive from one SRQ when asked to */
+  if (config.srq && !config.server_name && !res->srq) {
+    struct ibv_srq_init_attr srq_init_attr;
+    memset(&srq_init_attr, 0, sizeof srq_init_attr);
+    srq_init_attr.attr.max_wr = config.srq;
+    srq_init_attr.attr.max_sge = 1;
+    LOG_TIME(res->srq = ibv_create_srq(res->pd, &srq_init_attr),
+             "ibv_create_srq");
+    if (!res->srq) {
+      PRINT_ERR("failed to create SRQ with %d entries\n", config.srq);
+      return 1;
     }
-    if (res->pd) {
-      ibv_dealloc_pd(res->pd);
-      res->pd = NULL;
+  }
+  res->qp = create_qp(res);
+  if (!res->qp)
+    return 1;
+  PRINT("QP was created, QP number=0x%x, max inline data %u\n",
+        res->qp->qp_num, res->max_inline);
+  return 0;
+}
+
+static int qp_pool_create(struct qp_pool *pool, struct resources *res,
+                          int size) {
+  memset(pool, 0, sizeof *pool);
+  pool->qps = (struct ibv_qp **)calloc(size, sizeof(struct ibv_qp *));
+  if (!pool->qps) {
+    PRINT_ERR("failed to allocate QP pool of %d entries\n", size);
+    return 1;
+  }
+  pool->size = size;
+  while (pool->count < size) {
+    struct ibv_qp *qp = create_qp(res);
+    if (!qp)
+      return 1;
+    if (modify_qp_to_init(qp)) {
+      ibv_destroy_qp(qp);
+      return 1;
     }
-    if (res->ib_ctx) {
-      ibv_close_device(res->ib_ctx);
-      res->ib_ctx = NULL;
+    pool->qps[pool->count++] = qp;
+  }
+  return 0;
+}
+static struct ibv_qp *qp_pool_get(struct qp_pool *pool,
+                                  struct resources *res) {
+  struct ibv_qp *qp;
+  if (pool->count)
+    return pool->qps[--pool->count];
+  /* pool ran dry, pay the full creation cost */
+  qp = create_qp(res);
+  if (!qp)
+    return NULL;
+  if (modify_qp_to_init(qp)) {
+    ibv_destroy_qp(qp);
+    return NULL;
+  }
+  pool->created++;
+  return qp;
+}
+static int qp_pool_put(struct qp_pool *pool, struct ibv_qp *qp) {
+  int rc;
+  if (pool->count == pool->size) {
+    LOG_TIME_CHECK(rc = ibv_destroy_qp(qp), "ibv_destroy_qp", rc == 0);
+    return rc != 0;
+  }
+  /* RESET flushes the work queues and forgets the remote side, INIT makes the
+   * QP ready to be connected again */
+  rc = modify_qp_to_reset(qp);
+  if (!rc)
+    rc = modify_qp_to_init(qp);
+  if (rc) {
+    ibv_destroy_qp(qp);
+    return 1;
+  }
+  pool->qps[pool->count++] = qp;
+  return 0;
+}
+static int qp_pool_destroy(struct qp_pool *pool) {
+  int rc = 0;
+  while (pool->count) {
+    if (ibv_destroy_qp(pool->qps[--pool->count]))
+      rc = 1;
+  }
+  free(pool->qps);
+  pool->qps = NULL;
+  pool->size = 0;
+  return rc;
+}
+
+/* per level create/destroy functions and the handle telling if it is alive,
+ * indexed by enum res_level */
+static const struct {
+  const char *name;
+  int (*create)(struct resources *res);
+  int (*destroy)(struct resources *res);
+  size_t handle; /* offset of the handle in struct resources */
+} res_levels[RES_LEVEL_NUM] = {
+    [RES_LEVEL_NONE] = {"none", NULL, NULL, 0},
+    [RES_LEVEL_DEVICE] = {"device", resources_create_device,
+                          resources_destroy_device,
+                          offsetof(struct resources, ib_ctx)},
+    [RES_LEVEL_PD] = {"pd", resources_create_pd, resources_destroy_pd,
+                      offsetof(struct resources, pd)},
+    [RES_LEVEL_CQ] = {"cq", resources_create_cq, resources_destroy_cq,
+                      offsetof(struct resources, cq)},
+    [RES_LEVEL_MR] = {"mr", resources_create_mr, resources_destroy_mr,
+                      offsetof(struct resources, mr)},
+    [RES_LEVEL_QP] = {"qp", resources_create_qp, resources_destroy_qp,
+                      offsetof(struct resources, qp)},
+};
+
+static int res_level_alive(struct resources *res, int level) {
+  return *(void **)((char *)res + res_levels[level].handle) != NULL;
+}
+
+static int parse_res_level(const char *name) {
+  int level;
+  for (level = RES_LEVEL_NONE; level < RES_LEVEL_NUM; ++level) {
+    if (!strcmp(name, res_levels[level].name))
+      return level;
+  }
+  return -1;
+}
+
+static const char *cpu_counter_names[CPU_COUNTER_NUM] = {
+    "CYCLES", "INSTRUCTIONS", "PAGE_FAULTS", "DTLB_MISSES"};
+static struct {
+  int opened;                  /* counters_init ran */
+  int cpu_fd[CPU_COUNTER_NUM]; /* -1 = not available */
+  int num_port;
+  int port_fd[PORT_COUNTERS_MAX];
+  char port_name[PORT_COUNTERS_MAX][NAME_MAX + 1];
+} counters;
+
+static int counters_open_cpu(enum cpu_counter c, int exclude_kernel) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+  attr.size = sizeof attr;
+  attr.inherit = 1;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  switch (c) {
+  case CPU_CYCLES:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case CPU_INSTRUCTIONS:
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case CPU_PAGE_FAULTS:
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+    break;
+  default:
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  }
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+static void counters_open_port(const char *dev) {
+  static const char *dirs[] = {"counters", "hw_counters"};
+  char path[PATH_MAX];
+  struct dirent *e;
+  DIR *dir;
+  int d;
+  for (d = 0; d < 2; ++d) {
+    snprintf(path, sizeof path, "/sys/class/infiniband/%s/ports/%d/%s", dev,
+             config.ib_port, dirs[d]);
+    dir = opendir(path);
+    if (!dir)
+      continue;
+    while ((e = readdir(dir)) && counters.num_port < PORT_COUNTERS_MAX) {
+      char file[PATH_MAX + NAME_MAX + 2];
+      int fd;
+      /* lifespan is the refresh period of hw_counters, not a counter */
+      if (e->d_name[0] == '.' || !strcmp(e->d_name, "lifespan"))
+        continue;
+      snprintf(file, sizeof file, "%s/%s", path, e->d_name);
+      fd = open(file, O_RDONLY);
+      if (fd < 0)
+        continue;
+      counters.port_fd[counters.num_port] = fd;
+      snprintf(counters.port_name[counters.num_port++],
+               sizeof counters.port_name[0], "%s", e->d_name);
     }
-    if (dev_list) {
+    closedir(dir);
+  }
+}
+static int counters_init(void) {
+  struct ibv_device **dev_list;
+  int num_cpu = 0;
+  int i;
+  counters.opened = 1;
+  for (i = 0; i < CPU_COUNTER_NUM; ++i) {
+    counters.cpu_fd[i] = counters_open_cpu(i, 0);
+    if (counters.cpu_fd[i] < 0)
+      counters.cpu_fd[i] = counters_open_cpu(i, 1);
+    if (counters.cpu_fd[i] < 0)
+      PRINT_ERR("perf counter %s not available: %s\n", cpu_counter_names[i],
+                strerror(errno));
+    else
+      ++num_cpu;
+  }
+  if (config.dev_name) {
+    counters_open_port(config.dev_name);
+  } else {
+    dev_list = ibv_get_device_list(NULL);
+    if (dev_list && dev_list[0])
+      counters_open_port(ibv_get_device_name(dev_list[0]));
+    if (dev_list)
       ibv_free_device_list(dev_list);
-      dev_list = NULL;
+  }
+  if (!counters.num_port)
+    PRINT_ERR("no port counters found in /sys/class/infiniband\n");
+  return !num_cpu && !counters.num_port;
+}
+static void counters_close(void) {
+  int i;
+  if (!counters.opened)
+    return;
+  for (i = 0; i < CPU_COUNTER_NUM; ++i)
+    if (counters.cpu_fd[i] >= 0)
+      close(counters.cpu_fd[i]);
+  for (i = 0; i < counters.num_port; ++i)
+    close(counters.port_fd[i]);
+  counters.num_port = 0;
+  counters.opened = 0;
+}
+static void counters_cpu(uint64_t *cpu) {
+  int i;
+  for (i = 0; i < CPU_COUNTER_NUM; ++i) {
+    cpu[i] = 0;
+    if (counters.cpu_fd[i] >= 0 &&
+        read(counters.cpu_fd[i], &cpu[i], sizeof cpu[i]) != sizeof cpu[i])
+      cpu[i] = 0;
+  }
+}
+static void counters_snap(struct counter_snap *snap) {
+  char buf[32];
+  int i;
+  for (i = 0; i < counters.num_port; ++i) {
+    ssize_t n = pread(counters.port_fd[i], buf, sizeof buf - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+    snap->port[i] = strtoull(buf, NULL, 0);
+  }
+  counters_cpu(snap->cpu);
+}
+static void counters_add(struct counter_snap *sum,
+                         const struct counter_snap *begin,
+                         const struct counter_snap *end) {
+  int i;
+  for (i = 0; i < CPU_COUNTER_NUM; ++i)
+    sum->cpu[i] += end->cpu[i] - begin->cpu[i];
+  for (i = 0; i < counters.num_port; ++i)
+    sum->port[i] += end->port[i] - begin->port[i];
+}
+static void report_counters(const char *tag, const char *phase,
+                            const struct counter_snap *delta, size_t div) {
+  int printed = 0;
+  int i;
+  if (!div)
+    div = 1;
+  fprintf(stderr, "[Packet-%ld][%s] PHASE %s", MSG_SIZE, tag, phase);
+  for (i = 0; i < CPU_COUNTER_NUM; ++i) {
+    if (counters.cpu_fd[i] >= 0)
+      fprintf(stderr, "%s %s: %.1lf", printed++ ? "," : "",
+              cpu_counter_names[i], (double)delta->cpu[i] / div);
+  }
+  if (counters.cpu_fd[CPU_CYCLES] >= 0 &&
+      counters.cpu_fd[CPU_INSTRUCTIONS] >= 0 && delta->cpu[CPU_CYCLES])
+    fprintf(stderr, ", IPC: %.2lf",
+            (double)delta->cpu[CPU_INSTRUCTIONS] / delta->cpu[CPU_CYCLES]);
+  fprintf(stderr, "\n");
+  printed = 0;
+  for (i = 0; i < counters.num_port; ++i) {
+    if (!delta->port[i])
+      continue;
+    if (!printed++)
+      fprintf(stderr, "[Packet-%ld][%s] PHASE %s PORT", MSG_SIZE, tag, phase);
+    else
+      fprintf(stderr, ",");
+    fprintf(stderr, " %s: %.1lf", counters.port_name[i],
+            (double)delta->port[i] / div);
+  }
+  if (printed)
+    fprintf(stderr, "\n");
+}
+/* add the CPU counters since begin to a level */
+static void res_level_cpu_add(struct resources *res, int level,
+                              const uint64_t *begin) {
+  uint64_t end[CPU_COUNTER_NUM];
+  int i;
+  counters_cpu(end);
+  for (i = 0; i < CPU_COUNTER_NUM; ++i)
+    res->level_cpu[level][i] += end[i] - begin[i];
+}
+static int resources_create(struct resources *res) {
+  int level;
+  int rc = 0;
+  for (level = RES_LEVEL_DEVICE; level < RES_LEVEL_NUM; ++level) {
+    if (res_level_alive(res, level))
+      continue;
+    uint64_t cpu[CPU_COUNTER_NUM];
+    if (config.counters)
+      counters_cpu(cpu);
+    uint64_t t0 = timer_start();
+    rc = res_levels[level].create(res);
+    res->level_time[level] += timer_elapsed_ns(t0);
+    if (config.counters)
+      res_level_cpu_add(res, level, cpu);
+    if (rc) {
+      /* Error encountered, cleanup */
+      resources_release(res, RES_LEVEL_NONE);
+      break;
     }
   }
   return rc;
@@ -423,13 +1317,37 @@ static int modify_qp_to_init(struct ibv_qp *qp) {
   attr.qp_state = IBV_QPS_INIT;
   attr.port_num = config.ib_port;
   attr.pkey_index = 0;
-  attr.qp_access_flags =
-      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
-  flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+  if (config.transport == IBV_QPT_UD) {
+    attr.qkey = UD_QKEY;
+    flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY;
+  } else {
+    attr.qp_access_flags = access_flags();
+    flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+            IBV_QP_ACCESS_FLAGS;
+  }
   LOG_TIME_CHECK(rc = ibv_modify_qp(qp, &attr, flags), "ibv_modify_qp(init)",
                  rc == 0);
   return rc;
 }
+/* address vector of the peer, for the RC QP itself or a UD AH */
+static void fill_ah_attr(struct ibv_ah_attr *ah_attr, uint16_t dlid,
+                         const uint8_t *dgid) {
+  memset(ah_attr, 0, sizeof *ah_attr);
+  ah_attr->is_global = 0;
+  ah_attr->dlid = dlid;
+  ah_attr->sl = 0;
+  ah_attr->src_path_bits = 0;
+  ah_attr->port_num = config.ib_port;
+  if (config.gid_idx >= 0) {
+    ah_attr->is_global = 1;
+    ah_attr->port_num = 1;
+    memcpy(&ah_attr->grh.dgid, dgid, 16);
+    ah_attr->grh.flow_label = 0;
+    ah_attr->grh.hop_limit = 1;
+    ah_attr->grh.sgid_index = config.gid_idx;
+    ah_attr->grh.traffic_class = 0;
+  }
+}
 static int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn,
                             uint16_t dlid, uint8_t *dgid) {
   struct ibv_qp_attr attr;
@@ -437,27 +1355,19 @@ static int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn,
   int rc;
   memset(&attr, 0, sizeof(attr));
   attr.qp_state = IBV_QPS_RTR;
-  attr.path_mtu = IBV_MTU_256;
-  attr.dest_qp_num = remote_qpn;
-  attr.rq_psn = 0;
-  attr.max_dest_rd_atomic = 1;
-  attr.min_rnr_timer = 0x12;
-  attr.ah_attr.is_global = 0;
-  attr.ah_attr.dlid = dlid;
-  attr.ah_attr.sl = 0;
-  attr.ah_attr.src_path_bits = 0;
-  attr.ah_attr.port_num = config.ib_port;
-  if (config.gid_idx >= 0) {
-    attr.ah_attr.is_global = 1;
-    attr.ah_attr.port_num = 1;
-    memcpy(&attr.ah_attr.grh.dgid, dgid, 16);
-    attr.ah_attr.grh.flow_label = 0;
-    attr.ah_attr.grh.hop_limit = 1;
-    attr.ah_attr.grh.sgid_index = config.gid_idx;
-    attr.ah_attr.grh.traffic_class = 0;
-  }
-  flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
-          IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+  /* a UD QP has no peer, the address goes into an AH per destination */
+  if (config.transport == IBV_QPT_UD) {
+    flags = IBV_QP_STATE;
+  } else {
+    attr.path_mtu = config.mtu;
+    attr.dest_qp_num = remote_qpn;
+    attr.rq_psn = 0;
+    attr.max_dest_rd_atomic = config.rd_atomic;
+    attr.min_rnr_timer = 0x12;
+    fill_ah_attr(&attr.ah_attr, dlid, dgid);
+    flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+            IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+  }
   LOG_TIME_CHECK(rc = ibv_modify_qp(qp, &attr, flags), "ibv_modify_qp(rtr)",
                  rc == 0);
   return rc;
@@ -468,18 +1378,34 @@ static int modify_qp_to_rts(struct ibv_qp *qp) {
   int rc;
   memset(&attr, 0, sizeof(attr));
   attr.qp_state = IBV_QPS_RTS;
-  attr.timeout = 0x12;
-  attr.retry_cnt = 6;
-  attr.rnr_retry = 0;
   attr.sq_psn = 0;
-  attr.max_rd_atomic = 1;
-  flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
-          IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
+  if (config.transport == IBV_QPT_UD) {
+    /* no acknowledgements, so nothing to time out or retry */
+    flags = IBV_QP_STATE | IBV_QP_SQ_PSN;
+  } else {
+    attr.timeout = config.timeout;
+    attr.retry_cnt = config.retry_cnt;
+    /* retry forever on RNR, receivers repost their buffers as they go */
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = config.rd_atomic;
+    flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+            IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC;
+  }
   LOG_TIME_CHECK(rc = ibv_modify_qp(qp, &attr, flags), "ibv_modify_qp(rts)",
                  rc == 0);
   return rc;
 }
 
+static int modify_qp_to_reset(struct ibv_qp *qp) {
+  struct ibv_qp_attr attr;
+  int rc;
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_RESET;
+  LOG_TIME_CHECK(rc = ibv_modify_qp(qp, &attr, IBV_QP_STATE),
+                 "ibv_modify_qp(reset)", rc == 0);
+  return rc;
+}
+
 static int connect_qp(struct resources *res) {
   struct cm_con_data_t local_con_data;
   struct cm_con_data_t remote_con_data;
@@ -528,13 +1454,16 @@ static int connect_qp(struct resources *res) {
           "%02x:%02x:%02x\n ",
           p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10],
           p[11], p[12], p[13], p[14], p[15]);
+    /* PRINT compiles to nothing in LOG_TO_FILE builds */
+    (void)p;
   }
   /* modify the QP to init */
   RDMA_CHECK_GOTO(0 == modify_qp_to_init(res->qp),
                   "change QP state to INIT failed", connect_qp_exit);
 
-  /* let the client post RR to be prepared for incoming messages */
-  if (config.server_name) {
+  /* let the client post RR to be prepared for the incoming message of the
+   * setup test, the data path tests post their own */
+  if (config.server_name && config.test == TEST_SETUP) {
     RDMA_CHECK_GOTO(0 == post_receive(res), "failed to post RR",
                     connect_qp_exit);
   }
@@ -548,6 +1477,18 @@ static int connect_qp(struct resources *res) {
   RDMA_CHECK_GOTO(0 == modify_qp_to_rts(res->qp),
                   "failed to modify QP state to RTS", connect_qp_exit);
 
+  /* UD sends address the peer through an AH */
+  if (config.transport == IBV_QPT_UD) {
+    struct ibv_ah_attr ah_attr;
+    fill_ah_attr(&ah_attr, remote_con_data.lid, remote_con_data.gid);
+    LOG_TIME(res->ah = ibv_create_ah(res->pd, &ah_attr), "ibv_create_ah");
+    if (!res->ah) {
+      PRINT_ERR("failed to create AH\n");
+      rc = 1;
+      goto connect_qp_exit;
+    }
+  }
+
   /* sync to make sure that both sides are in states that they can connect to
    * prevent packet loose; just send a dummy char back and forth */
   RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "Q", &temp_char),
@@ -557,56 +1498,3336 @@ static int connect_qp(struct resources *res) {
 connect_qp_exit:
   return rc;
 }
-static int resources_destroy(struct resources *res) {
-  int rc = 0;
-  if (res->qp) {
-    int ret;
-    LOG_TIME_CHECK(ret = ibv_destroy_qp(res->qp), "ibv_destroy_qp", ret == 0);
-  }
-  if (res->mr) {
-    int ret;
-    LOG_TIME_CHECK(ret = ibv_dereg_mr(res->mr), "ibv_dereg_mr", ret == 0);
-  }
+static int reconnect_qp(struct resources *res) {
+  char temp_char;
+  int rc = 1;
+  /* the QP number stays, so the peer's connection data still holds and only
+   * the attributes change on the way back to RTS */
+  RDMA_CHECK_GOTO(0 == modify_qp_to_reset(res->qp),
+                  "failed to modify QP state to RESET", reconnect_qp_exit);
+  RDMA_CHECK_GOTO(0 == modify_qp_to_init(res->qp),
+                  "change QP state to INIT failed", reconnect_qp_exit);
+  RDMA_CHECK_GOTO(0 == modify_qp_to_rtr(res->qp, res->remote_props.qp_num,
+                                        res->remote_props.lid,
+                                        res->remote_props.gid),
+                  "failed to modify QP state to RTR", reconnect_qp_exit);
+  RDMA_CHECK_GOTO(0 == modify_qp_to_rts(res->qp),
+                  "failed to modify QP state to RTS", reconnect_qp_exit);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "Q", &temp_char),
+                  "sync error after QPs are were moved to RTS",
+                  reconnect_qp_exit);
+  rc = 0;
+
+reconnect_qp_exit:
+  return rc;
+}
+static int resources_destroy_qp(struct resources *res) {
+  int ret;
+  if (res->ah) {
+    LOG_TIME_CHECK(ret = ibv_destroy_ah(res->ah), "ibv_destroy_ah", ret == 0);
+    res->ah = NULL;
+  }
+  LOG_TIME_CHECK(ret = ibv_destroy_qp(res->qp), "ibv_destroy_qp", ret == 0);
+  res->qp = NULL;
+  if (res->srq) {
+    int srq_ret;
+    LOG_TIME_CHECK(srq_ret = ibv_destroy_srq(res->srq), "ibv_destroy_srq",
+                   srq_ret == 0);
+    res->srq = NULL;
+    ret |= srq_ret;
+  }
+  return ret != 0;
+}
+static int resources_destroy_mr(struct resources *res) {
+  int ret = 0;
+  if (reg_cache.pd == res->pd) {
+    /* the registration stays in the cache, the buffer stays with the PD */
+    LOG_TIME(reg_cache_put(&reg_cache, res->mr), "ibv_dereg_mr");
+    res->mr = NULL;
+    return 0;
+  }
+  LOG_TIME_CHECK(ret = ibv_dereg_mr(res->mr), "ibv_dereg_mr", ret == 0);
+  res->mr = NULL;
   if (res->buf)
-    free(res->buf);
-  if (res->cq) {
-    int ret;
-    LOG_TIME_CHECK(ret = ibv_destroy_cq(res->cq), "ibv_destroy_cq", ret == 0);
+    buffer_free(res->buf, res->buf_size + ud_grh());
+  res->buf = NULL;
+  return ret != 0;
+}
+static int resources_destroy_cq(struct resources *res) {
+  int ret;
+  LOG_TIME_CHECK(ret = ibv_destroy_cq(res->cq), "ibv_destroy_cq", ret == 0);
+  res->cq = NULL;
+  destroy_comp_channel(res);
+  return ret != 0;
+}
+static int resources_destroy_pd(struct resources *res) {
+  int ret;
+  if (reg_cache.pd == res->pd) {
+    if (res->buf)
+      buffer_free(res->buf, res->buf_size + ud_grh());
+    res->buf = NULL;
+    reg_cache_flush(&reg_cache);
+    reg_cache.pd = NULL;
+  }
+  LOG_TIME_CHECK(ret = ibv_dealloc_pd(res->pd), "ibv_dealloc_pd", ret == 0);
+  res->pd = NULL;
+  return ret != 0;
+}
+static int resources_destroy_device(struct resources *res) {
+  int ret;
+  LOG_TIME_CHECK(ret = ibv_close_device(res->ib_ctx), "ibv_close_device",
+                 ret == 0);
+  res->ib_ctx = NULL;
+  return ret != 0;
+}
+static int resources_release(struct resources *res, int keep) {
+  int level;
+  int rc = 0;
+  for (level = RES_LEVEL_NUM - 1; level > keep; --level) {
+    if (!res_level_alive(res, level))
+      continue;
+    uint64_t cpu[CPU_COUNTER_NUM];
+    if (config.counters)
+      counters_cpu(cpu);
+    uint64_t t0 = timer_start();
+    rc |= res_levels[level].destroy(res);
+    res->level_time[level] += timer_elapsed_ns(t0);
+    if (config.counters)
+      res_level_cpu_add(res, level, cpu);
+  }
+  /* a kept QP goes back to RESET so that it can be connected again */
+  if (keep >= RES_LEVEL_QP && res->qp) {
+    uint64_t t0 = timer_start();
+    rc |= modify_qp_to_reset(res->qp);
+    res->level_time[RES_LEVEL_QP] += timer_elapsed_ns(t0);
+  }
+  return rc;
+}
+static int resources_destroy(struct resources *res) {
+  return resources_release(res, RES_LEVEL_NONE);
+}
+static int sock_destroy(struct resources *res) {
+  int rc = 0;
+  if (res->sock >= 0) {
+    RDMA_CHECK(0 == close(res->sock), "failed to close socket");
+  }
+  return rc;
+}
+
+// Print the amortized setup cost of the main loop, overall and per level
+static void report_setup_cost(struct resources *res, double first_setup,
+                              double sum_setup) {
+  const char *reuse = res_levels[config.reuse].name;
+  int level;
+  fprintf(stderr,
+          "[Packet-%ld][reuse=%s] SETUP FIRST(ms): %.3lf, STEADY(ms): %.3lf, "
+          "AMORTIZED(ms): %.3lf\n",
+          MSG_SIZE, reuse, first_setup / 1e6,
+          LOOP > 1 ? (sum_setup - first_setup) / (LOOP - 1) / 1e6 : 0.0,
+          sum_setup / LOOP / 1e6);
+  /* the MR level split into its allocation, prefault and registration */
+  if (buf_stats.count) {
+    fprintf(stderr,
+            "[Packet-%ld][reuse=%s] BUFFER %s/%s ALLOC(us): %.2lf, "
+            "TOUCH(us): %.2lf, REG(us): %.2lf\n",
+            MSG_SIZE, reuse, alloc_names[config.alloc],
+            prefault_names[config.prefault],
+            buf_stats.alloc_ns / 1000.0 / buf_stats.count,
+            buf_stats.touch_ns / 1000.0 / buf_stats.count,
+            buf_stats.reg_ns / 1000.0 / buf_stats.count);
+  }
+  /* create + destroy time of every level, including the final teardown */
+  for (level = RES_LEVEL_DEVICE; level < RES_LEVEL_NUM; ++level) {
+    fprintf(stderr, "[Packet-%ld][reuse=%s] LEVEL %s AMORTIZED(us): %.2lf\n",
+            MSG_SIZE, reuse, res_levels[level].name,
+            res->level_time[level] / 1000.0 / LOOP);
+  }
+  /* where the level time went, e.g. page faults of the MR level */
+  if (config.counters) {
+    for (level = RES_LEVEL_DEVICE; level < RES_LEVEL_NUM; ++level) {
+      struct counter_snap delta;
+      char phase[32];
+      memset(&delta, 0, sizeof delta);
+      memcpy(delta.cpu, res->level_cpu[level], sizeof delta.cpu);
+      snprintf(phase, sizeof phase, "level-%s", res_levels[level].name);
+      report_counters("setup", phase, &delta, LOOP);
+    }
+  }
+}
+
+// Print the registration cache counters
+static void report_reg_cache(const char *tag) {
+  size_t lookups = reg_cache.hits + reg_cache.misses;
+  fprintf(stderr,
+          "[Packet-%ld][%s] REG_CACHE HITS: %zu, MISSES: %zu, HIT_RATE: %.2lf%%, "
+          "EVICTIONS: %zu, INVALIDATIONS: %zu\n",
+          MSG_SIZE, tag, reg_cache.hits, reg_cache.misses,
+          lookups ? 100.0 * reg_cache.hits / lookups : 0.0,
+          reg_cache.evictions, reg_cache.invalidations);
+  fprintf(stderr, "[Packet-%ld][%s] REG_CACHE HIT(us): %.3lf, MISS(us): %.3lf\n",
+          MSG_SIZE, tag,
+          reg_cache.hits ? reg_cache.hit_ns / 1000.0 / reg_cache.hits : 0.0,
+          reg_cache.misses ? reg_cache.miss_ns / 1000.0 / reg_cache.misses
+                           : 0.0);
+}
+
+static int run_setup_test(struct resources *res) {
+  int rc;
+  char temp_char;
+  double sum_time = 0;    // sum of all time
+  double sum10_time = 0;  // sum of 10 iterations time
+  double first_setup = 0; // setup time of the cold first iteration
+  double sum_setup = 0;   // setup time of all iterations
+  /* with --counters: counter deltas of setup (create + connect), transfer and
+   * teardown, snapshotted outside the setup time */
+  struct counter_snap snap[4];
+  struct counter_snap phase[3];
+  memset(phase, 0, sizeof phase);
+  for (size_t i = 0; i < LOOP; ++i) {
+    if (config.counters)
+      counters_snap(&snap[0]);
+    uint64_t _t = timer_start();
+    RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                    run_setup_test_exit);
+    /* connect the QPs */
+    RDMA_CHECK_GOTO(0 == connect_qp(res), "failed to connect QPs",
+                    run_setup_test_exit);
+    uint64_t _setup = timer_elapsed_ns(_t);
+    if (i == 0)
+      first_setup = _setup;
+    sum_setup += _setup;
+    if (config.counters)
+      counters_snap(&snap[1]);
+    /* let the server post the sr */
+    if (!config.server_name) {
+      RDMA_CHECK_GOTO(0 == post_send(res, IBV_WR_SEND), "failed to post sr",
+                      run_setup_test_exit);
+    }
+    /* in both sides we expect to get a completion */
+    RDMA_CHECK_GOTO(0 == poll_completion(res), "poll completion failed",
+                    run_setup_test_exit);
+
+    /* Sync so we are sure server side has data ready before client tries to
+     * read it; just send a dummy char back and forth */
+    RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "R", &temp_char),
+                    "sync error before RDMA ops", run_setup_test_exit);
+    if (config.counters)
+      counters_snap(&snap[2]);
+
+    /* only tear down the levels that are not reused by the next iteration */
+    RDMA_CHECK(0 == resources_release(res, config.reuse),
+               "failed to release resources");
+
+    _t = timer_elapsed_ns(_t);
+    if (config.counters) {
+      counters_snap(&snap[3]);
+      counters_add(&phase[0], &snap[0], &snap[1]);
+      counters_add(&phase[1], &snap[1], &snap[2]);
+      counters_add(&phase[2], &snap[2], &snap[3]);
+    }
+    sum_time += _t;
+    sum10_time += _t;
+    if (i % 10 == 9) {
+      fprintf(stderr,
+              "[Packet-%ld][%zu/%ld] TEN_ITER_AVG(ms): %.2lf, AVG_TIME(ms): %.2lf\n",
+              MSG_SIZE, i + 1, LOOP, sum10_time / 10.0 / 1e6, sum_time / (i + 1) / 1e6);
+      sum10_time = 0;
+    }
+  } // end for
+
+  /* the final teardown is part of the amortized cost as well */
+  rc = resources_destroy(res);
+  if (LOOP > 0)
+    report_setup_cost(res, first_setup, sum_setup);
+  if (config.counters && LOOP > 0) {
+    report_counters("setup", "setup", &phase[0], LOOP);
+    report_counters("setup", "transfer", &phase[1], LOOP);
+    report_counters("setup", "teardown", &phase[2], LOOP);
+  }
+  if (reg_cache.misses)
+    report_reg_cache("setup");
+  return rc;
+
+run_setup_test_exit:
+  return 1;
+}
+
+static int run_regcache_test(struct resources *res) {
+  char **bufs = NULL;
+  unsigned int seed = 1;
+  size_t budget;
+  int rc = 1;
+  int k;
+
+  RDMA_CHECK_GOTO(0 == resources_create_device(res) &&
+                      0 == resources_create_pd(res),
+                  "failed to create resources", run_regcache_test_exit);
+  /* by default only half of the working set fits, so that LRU eviction is
+   * exercised */
+  budget = config.reg_cache ? config.reg_cache
+                            : MSG_SIZE * (config.reg_cache_ws / 2);
+  reg_cache_init(&reg_cache, res->pd, budget);
+  bufs = (char **)calloc(config.reg_cache_ws, sizeof(char *));
+  RDMA_CHECK_GOTO(bufs, "failed to allocate buffer table",
+                  run_regcache_test_exit);
+  for (k = 0; k < config.reg_cache_ws; ++k) {
+    bufs[k] = buffer_alloc(MSG_SIZE);
+    RDMA_CHECK_GOTO(bufs[k], "failed to allocate buffer",
+                    run_regcache_test_exit);
+  }
+  for (size_t i = 0; i < LOOP; ++i) {
+    struct ibv_mr *mr;
+    k = rand_r(&seed) % config.reg_cache_ws;
+    mr = reg_cache_get(&reg_cache, bufs[k], MSG_SIZE);
+    RDMA_CHECK_GOTO(mr, "registration cache lookup failed",
+                    run_regcache_test_exit);
+    reg_cache_put(&reg_cache, mr);
+    /* a freed buffer must not be served from the cache afterwards */
+    if (i % 16 == 15) {
+      buffer_free(bufs[k], MSG_SIZE);
+      bufs[k] = buffer_alloc(MSG_SIZE);
+      RDMA_CHECK_GOTO(bufs[k], "failed to allocate buffer",
+                      run_regcache_test_exit);
+    }
+  }
+  fprintf(stderr, "[Packet-%ld][regcache] WORKING_SET: %d, BUDGET: %zu\n",
+          MSG_SIZE, config.reg_cache_ws, budget);
+  report_reg_cache("regcache");
+  rc = 0;
+
+run_regcache_test_exit:
+  if (bufs) {
+    for (k = 0; k < config.reg_cache_ws; ++k) {
+      if (bufs[k])
+        buffer_free(bufs[k], MSG_SIZE);
+    }
+    free(bufs);
+  }
+  return rc;
+}
+
+static int cq_poller_init(struct cq_poller *poller, struct resources *res,
+                          int batch) {
+  memset(poller, 0, sizeof *poller);
+  poller->wc = (struct ibv_wc *)calloc(batch, sizeof(struct ibv_wc));
+  if (!poller->wc) {
+    PRINT_ERR("failed to allocate %d work completions\n", batch);
+    return 1;
+  }
+  poller->cq = res->cq;
+  poller->batch = batch;
+  poller->timeout_cycles =
+      MAX_POLL_CQ_TIMEOUT * 1000000.0 / timer.ns_per_cycle;
+  poller->mode = res->channel ? config.cq_mode : CQ_MODE_BUSY;
+  poller->spin_cycles = config.spin * 1000.0 / timer.ns_per_cycle;
+  poller->channel = res->channel;
+  poller->epfd = res->epfd;
+  return 0;
+}
+static void cq_poller_on(struct cq_poller *poller, int kind,
+                         void (*handler)(struct ibv_wc *wc, void *arg),
+                         void *arg) {
+  poller->handler[kind] = handler;
+  poller->arg[kind] = arg;
+}
+/* arm the CQ and sleep until its next event, 1 if none came in time */
+static int cq_poller_sleep(struct cq_poller *poller) {
+  struct epoll_event ev;
+  struct ibv_cq *ev_cq;
+  void *ev_ctx;
+  int n;
+  do {
+    n = epoll_wait(poller->epfd, &ev, 1, MAX_POLL_CQ_TIMEOUT);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    PRINT_ERR("no CQ event %s\n", n ? "(epoll_wait failed)"
+                                     : "after timeout");
+    return 1;
+  }
+  if (ibv_get_cq_event(poller->channel, &ev_cq, &ev_ctx)) {
+    /* someone else took it, nothing to ack */
+    if (errno == EAGAIN)
+      return 0;
+    PRINT_ERR("ibv_get_cq_event failed\n");
+    return 1;
+  }
+  ibv_ack_cq_events(ev_cq, 1);
+  poller->sleeps++;
+  return 0;
+}
+/* one ibv_poll_cq, only the calls that found completions count as polling
+ * time, the empty ones are waiting */
+static inline int cq_poller_reap(struct cq_poller *poller) {
+  uint64_t c0 = get_cycles();
+  int n = ibv_poll_cq(poller->cq, poller->batch, poller->wc);
+  if (n > 0)
+    poller->poll_cycles += get_cycles() - c0;
+  return n;
+}
+/* wait for at least one completion, giving up after MAX_POLL_CQ_TIMEOUT ms
+ * without any */
+static int cq_poller_poll(struct cq_poller *poller) {
+  uint64_t start = 0;
+  uint64_t spin_start = 0;
+  size_t spins = 0;
+  int n;
+  int i;
+  while (!(n = cq_poller_reap(poller))) {
+    poller->empty_polls++;
+    if (poller->mode == CQ_MODE_HYBRID) {
+      if (!spin_start)
+        spin_start = get_cycles();
+      if (get_cycles() - spin_start < poller->spin_cycles)
+        continue;
+    }
+    if (poller->mode != CQ_MODE_BUSY) {
+      if (ibv_req_notify_cq(poller->cq, 0)) {
+        PRINT_ERR("ibv_req_notify_cq failed\n");
+        return -1;
+      }
+      /* a completion which arrived before the CQ was armed raises no event */
+      n = cq_poller_reap(poller);
+      if (n)
+        break;
+      if (cq_poller_sleep(poller))
+        return -1;
+      spin_start = 0;
+      continue;
+    }
+    /* the clock is only read every POLL_CQ_TIMEOUT_CHECK empty polls */
+    if (++spins % POLL_CQ_TIMEOUT_CHECK)
+      continue;
+    if (poller->idle) {
+      int idle = poller->idle(poller->idle_arg);
+      if (idle < 0)
+        return -1;
+      if (idle > 0)
+        start = 0;
+    }
+    if (!start) {
+      start = get_cycles();
+    } else if (get_cycles() - start > poller->timeout_cycles) {
+      PRINT_ERR("completion wasn't found in the CQ after timeout\n");
+      return -1;
+    }
+  }
+  if (n < 0) {
+    PRINT_ERR("poll CQ failed\n");
+    return -1;
+  }
+  poller->polls++;
+  poller->cqes += n;
+  for (i = 0; i < n; ++i) {
+    struct ibv_wc *wc = &poller->wc[i];
+    int kind = WRID_KIND(wc->wr_id);
+    if (wc->status != IBV_WC_SUCCESS) {
+      PRINT_ERR("got bad completion with status: 0x%x, vendor syndrome: 0x%x\n",
+                wc->status, wc->vendor_err);
+      return -1;
+    }
+    if (kind < WRID_KIND_NUM && poller->handler[kind])
+      poller->handler[kind](wc, poller->arg[kind]);
+  }
+  return n;
+}
+static void cq_poller_destroy(struct cq_poller *poller) {
+  free(poller->wc);
+  poller->wc = NULL;
+}
+
+/* fragment i of a scattered message, fragments are frag_size apart so that
+ * none of them is contiguous with the next */
+static char *bw_frag(struct resources *res, const struct bw_params *params,
+                     int i) {
+  return res->buf + (size_t)i * 2 * params->frag_size;
+}
+/* bounce buffer the packing alternative gathers the fragments into */
+static char *bw_bounce(struct resources *res, const struct bw_params *params) {
+  return bw_frag(res, params, params->frags);
+}
+static void bw_pack(struct resources *res, const struct bw_params *params) {
+  char *dst = bw_bounce(res, params);
+  int i;
+  for (i = 0; i < params->frags; ++i) {
+    memcpy(dst, bw_frag(res, params, i), params->frag_size);
+    dst += params->frag_size;
+  }
+}
+/* a signaled send completion retires every WR posted up to it */
+static void bw_on_send(struct ibv_wc *wc, void *arg) {
+  *(size_t *)arg = WRID_ID(wc->wr_id) + 1;
+}
+static void bw_on_recv(struct ibv_wc *wc, void *arg) {
+  (void)wc;
+  (*(size_t *)arg)++;
+}
+static void bw_poll_stats(const struct cq_poller *poller,
+                          struct bw_result *result) {
+  result->polls = poller->polls;
+  result->empty_polls = poller->empty_polls;
+  result->cqes = poller->cqes;
+  result->poll_cycles = poller->poll_cycles;
+}
+static int run_bw_send(struct resources *res, const struct bw_params *params,
+                       struct bw_result *result) {
+  struct ibv_send_wr *bad_wr = NULL;
+  struct ibv_send_wr *wrs;
+  struct cq_poller poller;
+  struct ibv_sge *sges = NULL;
+  size_t posted = 0;
+  size_t completed = 0;
+  uint64_t t0;
+  uint64_t c0;
+  int num_sge = params->frags > 1 && !params->pack ? params->frags : 1;
+  int batch = params->batch < params->qdepth ? params->batch : params->qdepth;
+  /* at least one signaled WR per window, or the send queue fills up without
+   * ever producing a completion */
+  int signal = params->signal < params->qdepth ? params->signal
+                                               : params->qdepth;
+  int inl = use_inline(res, params->opcode, params->size) ? IBV_SEND_INLINE
+                                                          : 0;
+  int rc = 1;
+  int i;
+
+  if (cq_poller_init(&poller, res, config.poll_batch))
+    return 1;
+  cq_poller_on(&poller, WRID_SEND, bw_on_send, &completed);
+  wrs = (struct ibv_send_wr *)calloc(batch, sizeof(struct ibv_send_wr));
+  sges = (struct ibv_sge *)calloc(num_sge, sizeof(struct ibv_sge));
+  if (!wrs || !sges) {
+    PRINT_ERR("failed to allocate %d work requests\n", batch);
+    goto run_bw_send_exit;
+  }
+  /* every WR moves the same buffer or the same fragments, so all of them
+   * share one SGE list */
+  if (params->frags > 1 && params->pack) {
+    sges[0].addr = (uintptr_t)bw_bounce(res, params);
+    sges[0].length = params->size;
+  } else if (params->frags > 1) {
+    for (i = 0; i < num_sge; ++i) {
+      sges[i].addr = (uintptr_t)bw_frag(res, params, i);
+      sges[i].length = params->frag_size;
+    }
+  } else {
+    sges[0].addr =
+        (uintptr_t)send_src(res, params->opcode, params->size, res->buf);
+    sges[0].length = params->size;
+  }
+  for (i = 0; i < num_sge; ++i)
+    sges[i].lkey = res->mr->lkey;
+  for (i = 0; i < batch; ++i) {
+    wrs[i].sg_list = sges;
+    wrs[i].num_sge = num_sge;
+    wrs[i].opcode = params->opcode;
+    if (params->opcode != IBV_WR_SEND) {
+      wrs[i].wr.rdma.remote_addr = res->remote_props.addr;
+      wrs[i].wr.rdma.rkey = res->remote_props.rkey;
+    } else if (res->ah) {
+      ud_dest(res, &wrs[i]);
+    }
+  }
+
+  t0 = get_time_ns();
+  c0 = get_cycles();
+  while (completed < params->iters) {
+    /* fill the window, one doorbell per chain of up to batch WRs */
+    while (posted < params->iters) {
+      int k = params->iters - posted < (size_t)batch
+                  ? (int)(params->iters - posted)
+                  : batch;
+      uint64_t c1;
+      if (posted - completed + k > (size_t)params->qdepth)
+        break;
+      for (i = 0; i < k; ++i) {
+        size_t id = posted + i;
+        wrs[i].wr_id = MAKE_WRID(WRID_SEND, id);
+        wrs[i].next = i + 1 < k ? &wrs[i + 1] : NULL;
+        /* signal every signal-th WR and the last one of every chain, an
+         * unsignaled chain tail would otherwise keep its slots until a later
+         * chain that no longer fits the window */
+        wrs[i].send_flags = (id + 1) % signal == 0 || i + 1 == k
+                                ? IBV_SEND_SIGNALED | inl
+                                : inl;
+      }
+      c1 = get_cycles();
+      /* the packing alternative pays one gather copy per message, all of
+       * them into the same bounce buffer since the bytes never change */
+      if (params->frags > 1 && params->pack) {
+        for (i = 0; i < k; ++i)
+          bw_pack(res, params);
+      }
+      if (ibv_post_send(res->qp, wrs, &bad_wr)) {
+        PRINT_ERR("failed to post WR %zu\n", posted);
+        goto run_bw_send_exit;
+      }
+      result->post_cycles += get_cycles() - c1;
+      result->posts++;
+      posted += k;
+    }
+    /* send queue completions are in order, a signaled WR retires every
+     * unsignaled WR posted before it and frees their slots in bulk */
+    if (cq_poller_poll(&poller) < 0)
+      goto run_bw_send_exit;
+  }
+  result->cycles = get_cycles() - c0;
+  result->ns = get_time_ns() - t0;
+  result->msgs = completed;
+  result->bytes = completed * params->size;
+  bw_poll_stats(&poller, result);
+  rc = 0;
+
+run_bw_send_exit:
+  free(sges);
+  free(wrs);
+  cq_poller_destroy(&poller);
+  return rc;
+}
+static int bw_post_recvs(struct resources *res, size_t size, int num) {
+  struct ibv_recv_wr *bad_wr = NULL;
+  struct ibv_recv_wr wr;
+  struct ibv_sge sge;
+  memset(&sge, 0, sizeof(sge));
+  sge.addr = (uintptr_t)res->buf;
+  sge.length = size + ud_grh();
+  sge.lkey = res->mr->lkey;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = MAKE_WRID(WRID_RECV, 0);
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  while (num--) {
+    if (ibv_post_recv(res->qp, &wr, &bad_wr)) {
+      PRINT_ERR("failed to post RR\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+/* the receives or WRs in flight at the start, the window or every message
+ * when fewer */
+static size_t bw_window(const struct bw_params *params) {
+  return (size_t)params->qdepth < params->iters ? (size_t)params->qdepth
+                                                : params->iters;
+}
+/* UD drops what finds no receive posted, so the receiver cannot count on
+ * every message; the sender's sync after its run ends the wait instead */
+static int bw_ud_idle(void *arg) {
+  struct resources *res = (struct resources *)arg;
+  char c;
+  return recv(res->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1 ? -1 : 0;
+}
+static int run_bw_recv(struct resources *res, const struct bw_params *params,
+                       struct bw_result *result) {
+  struct cq_poller poller;
+  size_t posted = bw_window(params);
+  size_t completed = 0;
+  uint64_t t0 = 0;
+  uint64_t c0 = 0;
+  int rc = 1;
+  int n;
+
+  if (cq_poller_init(&poller, res, config.poll_batch))
+    return 1;
+  cq_poller_on(&poller, WRID_RECV, bw_on_recv, &completed);
+  if (res->ah) {
+    poller.idle = bw_ud_idle;
+    poller.idle_arg = res;
+  }
+  while (completed < params->iters) {
+    n = cq_poller_poll(&poller);
+    if (n < 0 && res->ah && bw_ud_idle(res))
+      break;
+    if (n < 0)
+      goto run_bw_recv_exit;
+    /* the clock starts with the first message, not with the sync */
+    if (completed == (size_t)n) {
+      t0 = get_time_ns();
+      c0 = get_cycles();
+    }
+    /* give the slots back, but never more than will be consumed */
+    if (posted < params->iters) {
+      if ((size_t)n > params->iters - posted)
+        n = (int)(params->iters - posted);
+      if (bw_post_recvs(res, params->size, n))
+        goto run_bw_recv_exit;
+      posted += n;
+    }
+  }
+  result->cycles = get_cycles() - c0;
+  result->ns = get_time_ns() - t0;
+  result->msgs = completed;
+  result->bytes = completed * params->size;
+  bw_poll_stats(&poller, result);
+  rc = 0;
+
+run_bw_recv_exit:
+  cq_poller_destroy(&poller);
+  return rc;
+}
+static int lat_post(struct resources *res, int opcode, size_t size) {
+  struct ibv_send_wr *bad_wr = NULL;
+  struct ibv_send_wr wr;
+  struct ibv_sge sge;
+  memset(&sge, 0, sizeof(sge));
+  sge.addr =
+      (uintptr_t)send_src(res, opcode, size, res->buf + ud_grh() + size);
+  sge.length = size;
+  sge.lkey = res->mr->lkey;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = MAKE_WRID(WRID_SEND, 0);
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.opcode = opcode;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  if (use_inline(res, opcode, size))
+    wr.send_flags |= IBV_SEND_INLINE;
+  if (opcode == IBV_WR_RDMA_WRITE) {
+    wr.wr.rdma.remote_addr = res->remote_props.addr;
+    wr.wr.rdma.rkey = res->remote_props.rkey;
+  } else if (res->ah) {
+    ud_dest(res, &wr);
+  }
+  if (ibv_post_send(res->qp, &wr, &bad_wr)) {
+    PRINT_ERR("failed to post SR\n");
+    return 1;
+  }
+  return 0;
+}
+static void lat_on_wc(struct ibv_wc *wc, void *arg) {
+  (void)wc;
+  (*(int *)arg)--;
+}
+/* wait until the outstanding send and receive completions arrived */
+static int lat_wait_wc(struct cq_poller *poller, int *sends, int *recvs) {
+  while (*sends > 0 || *recvs > 0) {
+    if (cq_poller_poll(poller) < 0)
+      return 1;
+  }
+  return 0;
+}
+/* spin until the peer's RDMA WRITE placed seq in the last byte */
+static int lat_wait_byte(volatile char *last, char seq) {
+  uint64_t start = get_time_ns();
+  size_t spins = 0;
+  while (*last != seq) {
+    /* only look at the clock once in a while */
+    if (!(++spins & 0xffff) &&
+        get_time_ns() - start > MAX_POLL_CQ_TIMEOUT * 1000000ULL) {
+      PRINT_ERR("peer message wasn't found in the buffer after timeout\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+static int run_lat(struct resources *res, int opcode, size_t size,
+                   size_t iters, uint64_t *samples) {
+  volatile char *recv_last = res->buf + size - 1;
+  char *send_last =
+      send_src(res, opcode, size, res->buf + ud_grh() + size) + size - 1;
+  int initiator = config.server_name != NULL;
+  struct cq_poller poller;
+  int sends = 0;
+  int recvs = 0;
+  int rc = 0;
+  size_t i;
+  if (cq_poller_init(&poller, res, 2))
+    return 1;
+  cq_poller_on(&poller, WRID_SEND, lat_on_wc, &sends);
+  cq_poller_on(&poller, WRID_RECV, lat_on_wc, &recvs);
+  for (i = 0; i < iters && !rc; ++i) {
+    /* never 0, the value of an untouched buffer, and different from the
+     * previous iteration */
+    char seq = i % 255 + 1;
+    uint64_t t0;
+    *send_last = seq;
+    t0 = get_time_ns();
+    if (!initiator) {
+      /* pong: wait for the ping first */
+      if (opcode == IBV_WR_RDMA_WRITE) {
+        rc = lat_wait_byte(recv_last, seq);
+      } else {
+        recvs = 1;
+        rc = lat_wait_wc(&poller, &sends, &recvs) ||
+             bw_post_recvs(res, size, 1);
+      }
+      if (rc)
+        break;
+    }
+    rc = lat_post(res, opcode, size);
+    if (rc)
+      break;
+    sends = 1;
+    if (opcode == IBV_WR_RDMA_WRITE) {
+      rc = lat_wait_wc(&poller, &sends, &recvs);
+      if (!rc && initiator)
+        rc = lat_wait_byte(recv_last, seq);
+    } else {
+      recvs = initiator;
+      rc = lat_wait_wc(&poller, &sends, &recvs);
+      if (!rc && initiator)
+        rc = bw_post_recvs(res, size, 1);
+    }
+    if (initiator)
+      samples[i] = get_time_ns() - t0;
+  }
+  cq_poller_destroy(&poller);
+  return rc;
+}
+/* per run state of run_atomic, shared with its completion handler */
+struct atomic_state {
+  struct resources *res;
+  int opcode;
+  uint64_t *post_ns;  /* post time per window slot */
+  uint64_t *compare;  /* compare value per window slot */
+  uint64_t *expected; /* value last seen per remote slot */
+  uint64_t *samples;
+  struct atomic_result *result;
+};
+static void atomic_on_wc(struct ibv_wc *wc, void *arg) {
+  struct atomic_state *st = (struct atomic_state *)arg;
+  size_t id = WRID_ID(wc->wr_id);
+  int w = id % config.qdepth;
+  uint64_t fetched = ((uint64_t *)st->res->buf)[w];
+  st->samples[id] = get_time_ns() - st->post_ns[w];
+  if (st->opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
+    /* the swap took effect only if the slot held what was compared */
+    if (fetched == st->compare[w]) {
+      st->result->swaps++;
+      fetched++;
+    }
+    st->expected[id % config.slots] = fetched;
+  }
+  st->result->ops++;
+}
+static int run_atomic(struct resources *res, int opcode, size_t iters,
+                      uint64_t *samples, struct atomic_result *result) {
+  struct ibv_send_wr *bad_wr = NULL;
+  struct ibv_send_wr wr;
+  struct ibv_sge sge;
+  struct cq_poller poller;
+  struct atomic_state st;
+  size_t posted = 0;
+  uint64_t t0;
+  int rc = 1;
+
+  memset(&st, 0, sizeof st);
+  memset(result, 0, sizeof *result);
+  st.res = res;
+  st.opcode = opcode;
+  st.samples = samples;
+  st.result = result;
+  st.post_ns = (uint64_t *)calloc(config.qdepth, sizeof(uint64_t));
+  st.compare = (uint64_t *)calloc(config.qdepth, sizeof(uint64_t));
+  st.expected = (uint64_t *)calloc(config.slots, sizeof(uint64_t));
+  if (!st.post_ns || !st.compare || !st.expected) {
+    PRINT_ERR("failed to allocate atomic state\n");
+    goto run_atomic_exit;
+  }
+  if (cq_poller_init(&poller, res, config.poll_batch))
+    goto run_atomic_exit;
+  cq_poller_on(&poller, WRID_SEND, atomic_on_wc, &st);
+
+  memset(&sge, 0, sizeof sge);
+  sge.length = sizeof(uint64_t);
+  sge.lkey = res->mr->lkey;
+  memset(&wr, 0, sizeof wr);
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.opcode = opcode;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.atomic.rkey = res->remote_props.rkey;
+  t0 = get_time_ns();
+  while (result->ops < iters) {
+    /* every outstanding atomic owns a window slot for its fetched value */
+    while (posted < iters && posted - result->ops < (size_t)config.qdepth) {
+      int w = posted % config.qdepth;
+      int slot = posted % config.slots;
+      sge.addr = (uintptr_t)(res->buf + w * sizeof(uint64_t));
+      wr.wr_id = MAKE_WRID(WRID_SEND, posted);
+      wr.wr.atomic.remote_addr =
+          res->remote_props.addr + (uint64_t)slot * ATOMIC_SLOT_STRIDE;
+      if (opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+        wr.wr.atomic.compare_add = 1;
+      } else {
+        st.compare[w] = st.expected[slot];
+        wr.wr.atomic.compare_add = st.compare[w];
+        wr.wr.atomic.swap = st.compare[w] + 1;
+      }
+      st.post_ns[w] = get_time_ns();
+      if (ibv_post_send(res->qp, &wr, &bad_wr)) {
+        PRINT_ERR("failed to post atomic %zu\n", posted);
+        goto run_atomic_poller_exit;
+      }
+      posted++;
+    }
+    if (cq_poller_poll(&poller) < 0)
+      goto run_atomic_poller_exit;
+  }
+  result->ns = get_time_ns() - t0;
+  rc = 0;
+
+run_atomic_poller_exit:
+  cq_poller_destroy(&poller);
+run_atomic_exit:
+  free(st.post_ns);
+  free(st.compare);
+  free(st.expected);
+  return rc;
+}
+static void report_bw(const char *tag, const struct bw_params *params,
+                      const struct bw_result *result) {
+  double sec = result->ns / 1e9;
+  fprintf(stderr,
+          "[Packet-%zu][%s] %s QDEPTH: %d, BATCH: %d, SIGNAL: %d, FRAGS: %d, "
+          "MSGS: %zu, "
+          "TIME(ms): %.3lf, BW(GB/s): %.3lf, MSG_RATE(Mmsg/s): %.3lf, "
+          "CYCLES/MSG: %.1lf, POST_CYCLES/MSG: %.1lf, POLL_CYCLES/MSG: %.1lf, "
+          "CQES: %zu, CQES/POLL: %.2lf, EMPTY_POLLS: %zu\n",
+          params->size, tag, opcode_names[params->opcode], params->qdepth,
+          params->batch, params->signal, params->frags, result->msgs,
+          result->ns / 1e6,
+          sec > 0 ? result->bytes / sec / 1e9 : 0.0,
+          sec > 0 ? result->msgs / sec / 1e6 : 0.0,
+          result->msgs ? (double)result->cycles / result->msgs : 0.0,
+          result->msgs ? (double)result->post_cycles / result->msgs : 0.0,
+          result->msgs ? (double)result->poll_cycles / result->msgs : 0.0,
+          result->cqes,
+          result->polls ? (double)result->cqes / result->polls : 0.0,
+          result->empty_polls);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+static void report_latency(const char *tag, const char *name,
+                           uint64_t *samples, size_t n) {
+  double sum = 0;
+  size_t i;
+  if (!n)
+    return;
+  qsort(samples, n, sizeof(uint64_t), cmp_u64);
+  for (i = 0; i < n; ++i)
+    sum += samples[i];
+  fprintf(stderr,
+          "[Packet-%ld][%s] %s(us) MIN: %.3lf, AVG: %.3lf, P50: %.3lf, "
+          "P99: %.3lf, P99.9: %.3lf, MAX: %.3lf\n",
+          MSG_SIZE, tag, name, samples[0] / 1000.0, sum / n / 1000.0,
+          samples[n / 2] / 1000.0, samples[n * 99 / 100] / 1000.0,
+          samples[n * 999 / 1000] / 1000.0, samples[n - 1] / 1000.0);
+}
+
+static int run_qppool_test(struct resources *res) {
+  struct qp_pool pool = {0};
+  uint64_t *samples = NULL;
+  union ibv_gid my_gid;
+  struct ibv_qp *qp = NULL;
+  uint64_t t0;
+  size_t i;
+  int put_rc;
+  int rc = 1;
+
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  run_qppool_test_exit);
+  memset(&my_gid, 0, sizeof my_gid);
+  if (config.gid_idx >= 0)
+    RDMA_CHECK_GOTO(0 == ibv_query_gid(res->ib_ctx, config.ib_port,
+                                       config.gid_idx, &my_gid),
+                    "could not get gid", run_qppool_test_exit);
+  /* scratch to RTS, pool to RTS, destroy, recycle */
+  samples = (uint64_t *)calloc(4 * LOOP, sizeof(uint64_t));
+  RDMA_CHECK_GOTO(samples, "failed to allocate samples", run_qppool_test_exit);
+
+  t0 = get_time_ns();
+  RDMA_CHECK_GOTO(0 == qp_pool_create(&pool, res, config.qp_pool),
+                  "failed to create QP pool", run_qppool_test_exit);
+  fprintf(stderr, "[Packet-%ld][qppool] POOL_FILL(us): %.3lf for %d QPs\n",
+          MSG_SIZE, (get_time_ns() - t0) / 1000.0, config.qp_pool);
+
+  for (i = 0; i < LOOP; ++i) {
+    /* current path: create, INIT, RTR, RTS against the local QP */
+    t0 = get_time_ns();
+    RDMA_CHECK_GOTO(qp = create_qp(res), "failed to create QP",
+                    run_qppool_test_exit);
+    RDMA_CHECK_GOTO(0 == modify_qp_to_init(qp) &&
+                        0 == modify_qp_to_rtr(qp, res->qp->qp_num,
+                                              res->port_attr.lid,
+                                              my_gid.raw) &&
+                        0 == modify_qp_to_rts(qp),
+                    "failed to connect QP", run_qppool_test_exit);
+    samples[i] = get_time_ns() - t0;
+    t0 = get_time_ns();
+    RDMA_CHECK_GOTO(0 == ibv_destroy_qp(qp), "failed to destroy QP",
+                    run_qppool_test_exit);
+    qp = NULL;
+    samples[2 * LOOP + i] = get_time_ns() - t0;
+
+    /* pool path: acquire an INIT QP, RTR, RTS */
+    t0 = get_time_ns();
+    RDMA_CHECK_GOTO(qp = qp_pool_get(&pool, res), "failed to acquire QP",
+                    run_qppool_test_exit);
+    RDMA_CHECK_GOTO(0 == modify_qp_to_rtr(qp, res->qp->qp_num,
+                                          res->port_attr.lid, my_gid.raw) &&
+                        0 == modify_qp_to_rts(qp),
+                    "failed to connect pooled QP", run_qppool_test_exit);
+    samples[LOOP + i] = get_time_ns() - t0;
+    t0 = get_time_ns();
+    put_rc = qp_pool_put(&pool, qp);
+    /* the pool took the QP over, even when it failed to recycle it */
+    qp = NULL;
+    RDMA_CHECK_GOTO(0 == put_rc, "failed to recycle QP", run_qppool_test_exit);
+    samples[3 * LOOP + i] = get_time_ns() - t0;
+  }
+  report_latency("qppool", "SCRATCH_TO_RTS", samples, LOOP);
+  report_latency("qppool", "POOL_TO_RTS", samples + LOOP, LOOP);
+  report_latency("qppool", "DESTROY", samples + 2 * LOOP, LOOP);
+  report_latency("qppool", "RECYCLE", samples + 3 * LOOP, LOOP);
+  fprintf(stderr, "[Packet-%ld][qppool] POOL_EMPTY_CREATES: %zu\n", MSG_SIZE,
+          pool.created);
+  rc = 0;
+
+run_qppool_test_exit:
+  /* the pool QPs and a QP taken out of it use the CQ, they have to go
+   * before it */
+  if (qp && ibv_destroy_qp(qp))
+    rc = 1;
+  if (qp_pool_destroy(&pool))
+    rc = 1;
+  free(samples);
+  return rc;
+}
+
+/* rd_atomic as far as both directions of this device allow */
+static int cap_rd_atomic(const struct resources *res, int rd_atomic) {
+  if (rd_atomic > res->device_attr.max_qp_init_rd_atom)
+    rd_atomic = res->device_attr.max_qp_init_rd_atom;
+  if (rd_atomic > res->device_attr.max_qp_rd_atom)
+    rd_atomic = res->device_attr.max_qp_rd_atom;
+  return rd_atomic;
+}
+static int bw_setup(struct resources *res) {
+  if (is_atomic(config.opcode)) {
+    PRINT_ERR("atomics are only run by the atomic test\n");
+    return 1;
+  }
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  bw_setup_exit);
+  /* keep as many READs in flight as the window asks for and both the
+   * requester and the responder side of the device allow */
+  if (config.opcode == IBV_WR_RDMA_READ) {
+    config.rd_atomic = cap_rd_atomic(res, config.qdepth);
+  }
+  RDMA_CHECK_GOTO(0 == connect_qp(res), "failed to connect QPs",
+                  bw_setup_exit);
+  return 0;
+
+bw_setup_exit:
+  return 1;
+}
+static int bw_run_point(struct resources *res, const struct bw_params *params,
+                        const char *tag, struct bw_result *out) {
+  struct bw_result result;
+  char temp_char;
+  int initiator = config.server_name != NULL;
+
+  memset(&result, 0, sizeof result);
+  /* receives have to be in place before the first SEND arrives */
+  if (!initiator && params->opcode == IBV_WR_SEND)
+    RDMA_CHECK_GOTO(0 == bw_post_recvs(res, params->size,
+                                       bw_window(params)),
+                    "failed to post RR", bw_run_point_exit);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "B", &temp_char),
+                  "sync error before bandwidth test", bw_run_point_exit);
+
+  if (initiator) {
+    RDMA_CHECK_GOTO(0 == run_bw_send(res, params, &result),
+                    "bandwidth test failed", bw_run_point_exit);
+    report_bw(tag, params, &result);
+  } else if (params->opcode == IBV_WR_SEND) {
+    RDMA_CHECK_GOTO(0 == run_bw_recv(res, params, &result),
+                    "bandwidth test failed", bw_run_point_exit);
+    report_bw("recv", params, &result);
+  }
+  /* the passive side of WRITE and READ just waits here */
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "E", &temp_char),
+                  "sync error after bandwidth test", bw_run_point_exit);
+  if (out)
+    *out = result;
+  return 0;
+
+bw_run_point_exit:
+  return 1;
+}
+static void bw_params_init(struct bw_params *params) {
+  memset(params, 0, sizeof *params);
+  params->opcode = config.opcode;
+  params->qdepth = config.qdepth;
+  params->batch = 1;
+  params->signal = config.signal;
+  params->size = MSG_SIZE;
+  params->frags = 1;
+  params->frag_size = MSG_SIZE;
+  params->iters = LOOP;
+}
+/* core of worker thread i, from --cpus or thread i on core i */
+static int thread_cpu(int i) {
+  return config.num_cpus ? config.cpus[i % config.num_cpus]
+                         : i % sysconf(_SC_NPROCESSORS_ONLN);
+}
+/* attributes of a worker thread pinned to cpu, unless cpu is negative */
+static void thread_attr_init(pthread_attr_t *attr, int cpu) {
+  cpu_set_t cpus;
+  pthread_attr_init(attr);
+  if (cpu < 0)
+    return;
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  pthread_attr_setaffinity_np(attr, sizeof cpus, &cpus);
+}
+static void *bw_thread_main(void *arg) {
+  struct bw_thread *t = (struct bw_thread *)arg;
+  t->start_ns = get_time_ns();
+  if (config.server_name)
+    t->rc = run_bw_send(&t->res, t->params, &t->result);
+  else
+    t->rc = run_bw_recv(&t->res, t->params, &t->result);
+  t->end_ns = get_time_ns();
+  return NULL;
+}
+/* run the engine on the first num workers at once */
+static int bw_threads_point(struct bw_thread *threads, int num,
+                            const struct bw_params *params,
+                            struct bw_result *total, uint64_t *ns) {
+  pthread_attr_t attr;
+  uint64_t start = UINT64_MAX;
+  uint64_t end = 0;
+  char temp_char;
+  int i;
+  int rc = 1;
+  int active = !config.server_name || params->opcode == IBV_WR_SEND;
+
+  memset(total, 0, sizeof *total);
+  for (i = 0; i < num && !config.server_name && params->opcode == IBV_WR_SEND;
+       ++i)
+    RDMA_CHECK_GOTO(0 == bw_post_recvs(&threads[i].res, params->size,
+                                       bw_window(params)),
+                    "failed to post RR", bw_threads_point_exit);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(threads[0].res.sock, 1, "B", &temp_char),
+                  "sync error before bandwidth test", bw_threads_point_exit);
+  /* the passive side of WRITE and READ has nothing to run */
+  for (i = 0; i < num && active; ++i) {
+    struct bw_thread *t = &threads[i];
+    memset(&t->result, 0, sizeof t->result);
+    t->params = params;
+    t->rc = 0;
+    thread_attr_init(&attr, t->cpu);
+    t->rc = pthread_create(&t->thread, &attr, bw_thread_main, t);
+    pthread_attr_destroy(&attr);
+    if (t->rc) {
+      PRINT_ERR("failed to start thread %d\n", i);
+      num = i;
+      break;
+    }
+  }
+  for (i = 0; i < num && active; ++i) {
+    struct bw_thread *t = &threads[i];
+    pthread_join(t->thread, NULL);
+    if (t->rc)
+      continue;
+    total->msgs += t->result.msgs;
+    total->bytes += t->result.bytes;
+    total->cycles += t->result.cycles;
+    if (t->start_ns < start)
+      start = t->start_ns;
+    if (t->end_ns > end)
+      end = t->end_ns;
+  }
+  *ns = end > start ? end - start : 0;
+  RDMA_CHECK_GOTO(0 == sock_sync_data(threads[0].res.sock, 1, "E", &temp_char),
+                  "sync error after bandwidth test", bw_threads_point_exit);
+  rc = 0;
+  for (i = 0; i < num && active; ++i)
+    rc |= threads[i].rc;
+
+bw_threads_point_exit:
+  return rc;
+}
+static int run_bw_threads(struct resources *res) {
+  struct bw_thread *threads = NULL;
+  struct bw_params params;
+  struct bw_result total;
+  double base_rate = 0;
+  uint64_t ns;
+  int level;
+  int num;
+  int i;
+  int rc = 1;
+
+  if (config.reg_cache) {
+    PRINT_ERR("the registration cache is not shared between threads\n");
+    return 1;
+  }
+  if (is_atomic(config.opcode)) {
+    PRINT_ERR("atomics are only run by the atomic test\n");
+    return 1;
+  }
+  /* device context and PD are shared, everything below is per thread */
+  RDMA_CHECK_GOTO(0 == resources_create_device(res),
+                  "failed to open the device", run_bw_threads_exit);
+  RDMA_CHECK_GOTO(0 == resources_create_pd(res), "failed to allocate the PD",
+                  run_bw_threads_exit);
+  if (config.opcode == IBV_WR_RDMA_READ) {
+    config.rd_atomic = cap_rd_atomic(res, config.qdepth);
+  }
+  threads = (struct bw_thread *)calloc(config.threads, sizeof *threads);
+  RDMA_CHECK_GOTO(threads, "failed to allocate threads", run_bw_threads_exit);
+  for (i = 0; i < config.threads; ++i) {
+    struct bw_thread *t = &threads[i];
+    t->index = i;
+    t->cpu = thread_cpu(i);
+    t->res = *res;
+    /* only the levels above the PD, a failure must not close the shared
+     * context the way resources_create would */
+    for (level = RES_LEVEL_PD + 1; level < RES_LEVEL_NUM; ++level)
+      RDMA_CHECK_GOTO(0 == res_levels[level].create(&t->res),
+                      "failed to create thread resources",
+                      run_bw_threads_exit);
+    RDMA_CHECK_GOTO(0 == connect_qp(&t->res), "failed to connect QPs",
+                    run_bw_threads_exit);
+  }
+  bw_params_init(&params);
+  for (num = 1;; num = num * 2 < config.threads ? num * 2 : config.threads) {
+    double sec;
+    double rate;
+    RDMA_CHECK_GOTO(0 == bw_threads_point(threads, num, &params, &total, &ns),
+                    "bandwidth test failed", run_bw_threads_exit);
+    for (i = 0; i < num && total.msgs; ++i) {
+      char tag[32];
+      snprintf(tag, sizeof tag, "%s-t%d",
+               config.server_name ? "bw" : "recv", i);
+      report_bw(tag, &params, &threads[i].result);
+    }
+    sec = ns / 1e9;
+    rate = sec > 0 ? total.msgs / sec : 0;
+    if (num == 1)
+      base_rate = rate;
+    if (total.msgs)
+      fprintf(stderr,
+              "[Packet-%zu][mt] %s THREADS: %d, MSGS: %zu, TIME(ms): %.3lf, "
+              "BW(GB/s): %.3lf, MSG_RATE(Mmsg/s): %.3lf, CYCLES/MSG: %.1lf, "
+              "EFFICIENCY: %.3lf\n",
+              params.size, opcode_names[params.opcode], num, total.msgs,
+              ns / 1e6, sec > 0 ? total.bytes / sec / 1e9 : 0.0, rate / 1e6,
+              (double)total.cycles / total.msgs,
+              base_rate > 0 ? rate / (num * base_rate) : 0.0);
+    if (num == config.threads)
+      break;
+  }
+  rc = 0;
+
+run_bw_threads_exit:
+  for (i = 0; threads && i < config.threads; ++i) {
+    if (threads[i].res.pd)
+      resources_release(&threads[i].res, RES_LEVEL_PD);
+  }
+  free(threads);
+  return rc;
+}
+static int run_bw_test(struct resources *res) {
+  struct bw_params params;
+  if (config.threads > 1)
+    return run_bw_threads(res);
+  if (bw_setup(res))
+    return 1;
+  bw_params_init(&params);
+  return bw_run_point(res, &params,
+                      config.transport == IBV_QPT_UD ? "bw-ud" : "bw", NULL);
+}
+static int run_sig_test(struct resources *res) {
+  struct bw_params params;
+  /* a window of one WR leaves nothing to leave unsignaled */
+  if (config.qdepth == 1)
+    config.qdepth = 64;
+  if (bw_setup(res))
+    return 1;
+  bw_params_init(&params);
+  /* powers of two, then config.qdepth itself when it is not one */
+  for (params.signal = 1;;
+       params.signal = params.signal * 2 < config.qdepth ? params.signal * 2
+                                                         : config.qdepth) {
+    if (bw_run_point(res, &params, "sig", NULL))
+      return 1;
+    if (params.signal == config.qdepth)
+      break;
+  }
+  return 0;
+}
+static int run_batch_test(struct resources *res) {
+  struct bw_params params;
+  /* several of the largest chains have to fit in the send queue, with a
+   * window of one chain every doorbell would wait for the previous chain to
+   * drain */
+  if (config.qdepth < BATCH_WINDOW_CHAINS * config.batch)
+    config.qdepth = BATCH_WINDOW_CHAINS * config.batch;
+  if (bw_setup(res))
+    return 1;
+  bw_params_init(&params);
+  /* powers of two, then config.batch itself when it is not one */
+  for (params.batch = 1;;
+       params.batch = params.batch * 2 < config.batch ? params.batch * 2
+                                                      : config.batch) {
+    if (bw_run_point(res, &params, "batch", NULL))
+      return 1;
+    if (params.batch == config.batch)
+      break;
+  }
+  return 0;
+}
+static uint64_t timeval_usec(const struct timeval *tv) {
+  return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+/* CPU time consumed between two getrusage(RUSAGE_SELF) snapshots */
+static void report_cpu(const char *tag, const struct rusage *r0,
+                       const struct rusage *r1, size_t iters) {
+  uint64_t user = timeval_usec(&r1->ru_utime) - timeval_usec(&r0->ru_utime);
+  uint64_t sys = timeval_usec(&r1->ru_stime) - timeval_usec(&r0->ru_stime);
+  fprintf(stderr,
+          "[Packet-%ld][%s] CPU_USER(us): %" PRIu64 ", CPU_SYS(us): %" PRIu64
+          ", CPU/ITER(us): %.3lf, VOL_CSW: %ld, INVOL_CSW: %ld\n",
+          MSG_SIZE, tag, user, sys, iters ? (double)(user + sys) / iters : 0.0,
+          r1->ru_nvcsw - r0->ru_nvcsw, r1->ru_nivcsw - r0->ru_nivcsw);
+}
+/* one latency run on a connected QP, both sides report their CPU time */
+static int lat_run_point(struct resources *res, uint64_t *samples,
+                         const char *tag) {
+  struct rusage r0;
+  struct rusage r1;
+  char temp_char;
+  int rc = 1;
+
+  if (config.opcode == IBV_WR_SEND)
+    RDMA_CHECK_GOTO(0 == bw_post_recvs(res, MSG_SIZE, 1), "failed to post RR",
+                    lat_run_point_exit);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "B", &temp_char),
+                  "sync error before latency test", lat_run_point_exit);
+  getrusage(RUSAGE_SELF, &r0);
+  RDMA_CHECK_GOTO(0 == run_lat(res, config.opcode, MSG_SIZE, LOOP, samples),
+                  "latency test failed", lat_run_point_exit);
+  getrusage(RUSAGE_SELF, &r1);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "E", &temp_char),
+                  "sync error after latency test", lat_run_point_exit);
+  if (config.server_name)
+    report_latency(tag, config.opcode == IBV_WR_SEND ? "send RTT"
+                                                     : "write RTT",
+                   samples, LOOP);
+  report_cpu(tag, &r0, &r1, LOOP);
+  rc = 0;
+
+lat_run_point_exit:
+  return rc;
+}
+/* connect once for the lat and cqmode tests */
+static int lat_setup(struct resources *res, uint64_t **samples) {
+  int rc = 1;
+
+  if (config.opcode != IBV_WR_RDMA_WRITE && config.opcode != IBV_WR_SEND) {
+    PRINT_ERR("lat test supports write and send only\n");
+    return 1;
+  }
+  /* receive half followed by send half */
+  res->buf_size = 2 * MSG_SIZE;
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  lat_setup_exit);
+  RDMA_CHECK_GOTO(0 == connect_qp(res), "failed to connect QPs",
+                  lat_setup_exit);
+  *samples = (uint64_t *)calloc(LOOP, sizeof(uint64_t));
+  RDMA_CHECK_GOTO(*samples, "failed to allocate samples", lat_setup_exit);
+  rc = 0;
+
+lat_setup_exit:
+  return rc;
+}
+static int run_lat_test(struct resources *res) {
+  uint64_t *samples = NULL;
+  int rc = 1;
+
+  RDMA_CHECK_GOTO(0 == lat_setup(res, &samples), "failed to set up lat test",
+                  run_lat_test_exit);
+  RDMA_CHECK_GOTO(0 == lat_run_point(res, samples,
+                                     config.transport == IBV_QPT_UD ? "lat-ud"
+                                                                    : "lat"),
+                  "latency test failed", run_lat_test_exit);
+  rc = 0;
+
+run_lat_test_exit:
+  free(samples);
+  return rc;
+}
+static int run_cqmode_test(struct resources *res) {
+  uint64_t *samples = NULL;
+  int mode;
+  int rc = 1;
+
+  RDMA_CHECK_GOTO(0 == lat_setup(res, &samples),
+                  "failed to set up cqmode test", run_cqmode_test_exit);
+  for (mode = 0; mode < CQ_MODE_NUM; ++mode) {
+    /* cq_poller_init picks the mode up from config */
+    config.cq_mode = mode;
+    RDMA_CHECK_GOTO(0 == lat_run_point(res, samples, cq_mode_names[mode]),
+                    "latency test failed", run_cqmode_test_exit);
+  }
+  rc = 0;
+
+run_cqmode_test_exit:
+  free(samples);
+  return rc;
+}
+static int run_inline_test(struct resources *res) {
+  struct bw_params params;
+  uint64_t *samples = NULL;
+  uint32_t granted;
+  uint32_t remote;
+  size_t size;
+  int on;
+  int rc = 1;
+
+  /* the largest inline size the device grants, unless -I caps it */
+  if (!config.inline_size)
+    config.inline_size = -1;
+  MSG_SIZE = INLINE_TEST_MAX;
+  RDMA_CHECK_GOTO(0 == lat_setup(res, &samples),
+                  "failed to set up inline test", run_inline_test_exit);
+  /* both sides have to run the same sizes, the smaller grant bounds them */
+  granted = htonl(res->max_inline);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, sizeof granted,
+                                      (char *)&granted, (char *)&remote),
+                  "failed to exchange the inline grants", run_inline_test_exit);
+  granted = res->max_inline < ntohl(remote) ? res->max_inline : ntohl(remote);
+  res->inline_buf = (char *)calloc(1, INLINE_TEST_MAX);
+  RDMA_CHECK_GOTO(res->inline_buf, "failed to allocate inline buffer",
+                  run_inline_test_exit);
+  fprintf(stderr, "[inline] MAX_INLINE_DATA: %u\n", granted);
+  for (size = 1; size <= INLINE_TEST_MAX; size *= 2) {
+    for (on = 0; on < 2 && (!on || size <= granted); ++on) {
+      const char *tag = on ? "inline" : "noinline";
+      res->max_inline = on ? granted : 0;
+      MSG_SIZE = size;
+      /* stale sequence bytes of the previous size must not end a wait */
+      memset(res->buf, 0, res->buf_size);
+      memset(res->inline_buf, 0, INLINE_TEST_MAX);
+      RDMA_CHECK_GOTO(0 == lat_run_point(res, samples, tag),
+                      "latency test failed", run_inline_test_exit);
+      bw_params_init(&params);
+      RDMA_CHECK_GOTO(0 == bw_run_point(res, &params, tag, NULL),
+                      "bandwidth test failed", run_inline_test_exit);
+    }
+  }
+  rc = 0;
+
+run_inline_test_exit:
+  free(res->inline_buf);
+  res->inline_buf = NULL;
+  free(samples);
+  return rc;
+}
+static int run_sge_test(struct resources *res) {
+  struct bw_params params;
+  size_t frag_size;
+  uint32_t max_frags;
+  uint32_t remote;
+  uint32_t frags;
+
+  if (config.opcode != IBV_WR_SEND && config.opcode != IBV_WR_RDMA_WRITE) {
+    PRINT_ERR("sge test supports write and send only\n");
+    return 1;
+  }
+  if (config.frags == 1)
+    config.frags = SGE_TEST_FRAGS;
+  /* MSG_SIZE is the largest fragment, the fragments leave gaps of their own
+   * size and the bounce buffer follows them */
+  res->buf_size = 3 * (size_t)config.frags * MSG_SIZE;
+  if (bw_setup(res))
+    return 1;
+  /* both sides have to run the same points: up to -F fragments and what
+   * the smaller of the two grants allows */
+  max_frags = htonl(res->max_send_sge);
+  if (sock_sync_data(res->sock, sizeof max_frags, (char *)&max_frags,
+                     (char *)&remote)) {
+    PRINT_ERR("failed to exchange the SGE limits\n");
+    return 1;
+  }
+  max_frags = res->max_send_sge < ntohl(remote) ? res->max_send_sge
+                                                : ntohl(remote);
+  if (max_frags > (uint32_t)config.frags)
+    max_frags = config.frags;
+  bw_params_init(&params);
+  for (frag_size = SGE_TEST_MIN_FRAG; frag_size <= MSG_SIZE;
+       frag_size *= SGE_TEST_FRAG_STEP) {
+    for (frags = 1; frags <= max_frags; frags *= 2) {
+      params.frags = frags;
+      params.frag_size = frag_size;
+      params.size = frags * frag_size;
+      for (params.pack = 0; params.pack < 2; ++params.pack) {
+        /* a single fragment has nothing to pack */
+        if (params.pack && frags == 1)
+          break;
+        if (bw_run_point(res, &params, params.pack ? "pack" : "sge", NULL))
+          return 1;
+      }
+    }
+  }
+  return 0;
+}
+/* swap a sweep_ctrl with the peer, converting to and from network order */
+static int sweep_exchange(struct resources *res, const struct sweep_ctrl *local,
+                          struct sweep_ctrl *remote) {
+  struct sweep_ctrl tmp;
+  tmp.cmd = htonl(local->cmd);
+  tmp.opcode = htonl(local->opcode);
+  tmp.mtu = htonl(local->mtu);
+  tmp.rd_atomic = htonl(local->rd_atomic);
+  tmp.qdepth = htonl(local->qdepth);
+  tmp.ok = htonl(local->ok);
+  tmp.size = htonll(local->size);
+  if (sock_sync_data(res->sock, sizeof tmp, (char *)&tmp, (char *)remote))
+    return 1;
+  remote->cmd = ntohl(remote->cmd);
+  remote->opcode = ntohl(remote->opcode);
+  remote->mtu = ntohl(remote->mtu);
+  remote->rd_atomic = ntohl(remote->rd_atomic);
+  remote->qdepth = ntohl(remote->qdepth);
+  remote->ok = ntohl(remote->ok);
+  remote->size = ntohll(remote->size);
+  return 0;
+}
+/* point i of the sweep, the size varying fastest, SWEEP_END past the last */
+static void sweep_point(int i, struct sweep_ctrl *ctrl) {
+  int total = sweep.num_sizes * sweep.num_mtus * sweep.num_opcodes *
+              sweep.num_rd_atomics;
+  memset(ctrl, 0, sizeof *ctrl);
+  if (i >= total) {
+    ctrl->cmd = SWEEP_END;
+    return;
+  }
+  ctrl->cmd = SWEEP_POINT;
+  ctrl->size = sweep.sizes[i % sweep.num_sizes];
+  i /= sweep.num_sizes;
+  ctrl->opcode = sweep.opcodes[i % sweep.num_opcodes];
+  i /= sweep.num_opcodes;
+  ctrl->rd_atomic = sweep.rd_atomics[i % sweep.num_rd_atomics];
+  i /= sweep.num_rd_atomics;
+  ctrl->mtu = sweep.mtus[i];
+}
+/* fill the dimensions not given on the command line from the config, all
+ * but the MTU, which is only known once the port is queried */
+static void sweep_defaults(void) {
+  size_t size;
+  if (!sweep.num_sizes) {
+    for (size = 1; size <= MSG_SIZE && sweep.num_sizes < SWEEP_MAX;
+         size *= 4)
+      sweep.sizes[sweep.num_sizes++] = size;
+  }
+  if (!sweep.num_opcodes)
+    sweep.opcodes[sweep.num_opcodes++] = config.opcode;
+  if (!sweep.num_rd_atomics)
+    sweep.rd_atomics[sweep.num_rd_atomics++] = config.rd_atomic;
+}
+static int run_sweep_test(struct resources *res) {
+  struct sweep_ctrl local;
+  struct sweep_ctrl remote;
+  const struct sweep_ctrl *point;
+  struct bw_params params;
+  struct bw_result result;
+  FILE *out = NULL;
+  uint64_t t0 = get_time_ns();
+  int initiator = config.server_name != NULL;
+  uint32_t last_mtu = 0;
+  int last_rd_atomic = -1;
+  int rd_atomic;
+  int points = 0;
+  int skipped = 0;
+  int i;
+  int rc = 1;
+
+  /* the server learns the buffer size and window from the client */
+  memset(&local, 0, sizeof local);
+  if (initiator) {
+    sweep_defaults();
+    for (i = 0; i < sweep.num_opcodes; ++i) {
+      if (is_atomic(sweep.opcodes[i])) {
+        PRINT_ERR("atomics are only run by the atomic test\n");
+        return 1;
+      }
+    }
+    local.cmd = SWEEP_BEGIN;
+    local.qdepth = config.qdepth;
+    for (i = 0; i < sweep.num_sizes; ++i) {
+      if (sweep.sizes[i] > local.size)
+        local.size = sweep.sizes[i];
+    }
+  }
+  RDMA_CHECK_GOTO(0 == sweep_exchange(res, &local, &remote),
+                  "failed to start the sweep", run_sweep_test_exit);
+  point = initiator ? &local : &remote;
+  res->buf_size = point->size;
+  config.qdepth = point->qdepth;
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  run_sweep_test_exit);
+  RDMA_CHECK_GOTO(0 == connect_qp(res), "failed to connect QPs",
+                  run_sweep_test_exit);
+  /* resources_create set config.mtu to the active MTU unless -M was given */
+  if (initiator && !sweep.num_mtus)
+    sweep.mtus[sweep.num_mtus++] = config.mtu;
+  if (initiator && config.output) {
+    out = fopen(config.output, "w");
+    RDMA_CHECK_GOTO(out, "failed to open the sweep output\n",
+                    run_sweep_test_exit);
+    fprintf(out, "size,opcode,mtu,rd_atomic,timeout,retry_cnt,qdepth,msgs,"
+                 "time_ns,bw_gbps,msg_rate_mmsgs,cycles_per_msg\n");
+  }
+
+  for (i = 0;; ++i) {
+    if (initiator)
+      sweep_point(i, &local);
+    else
+      local.cmd = SWEEP_POINT;
+    local.ok = 1;
+    RDMA_CHECK_GOTO(0 == sweep_exchange(res, &local, &remote),
+                    "failed to negotiate the next point", run_sweep_test_exit);
+    point = initiator ? &local : &remote;
+    if (point->cmd == SWEEP_END)
+      break;
+    /* both sides check the point against their own port and cap rd_atomic
+     * by their own device, the smaller cap holds for both */
+    rd_atomic = cap_rd_atomic(res, point->rd_atomic);
+    local.ok = point->mtu <= res->port_attr.active_mtu;
+    local.rd_atomic = rd_atomic;
+    RDMA_CHECK_GOTO(0 == sweep_exchange(res, &local, &remote),
+                    "failed to negotiate the next point", run_sweep_test_exit);
+    if ((int)remote.rd_atomic < rd_atomic)
+      rd_atomic = remote.rd_atomic;
+    if (!local.ok || !remote.ok) {
+      fprintf(stderr,
+              "[Packet-%" PRIu64 "][sweep] %s MTU: %d skipped, exceeds the "
+              "active MTU\n",
+              point->size, opcode_names[point->opcode],
+              mtu_bytes(point->mtu));
+      skipped++;
+      continue;
+    }
+    /* compared against the last negotiated point, never the local config,
+     * so that both sides reconnect together; the first point always does */
+    if (point->mtu != last_mtu || rd_atomic != last_rd_atomic) {
+      config.mtu = last_mtu = point->mtu;
+      config.rd_atomic = last_rd_atomic = rd_atomic;
+      RDMA_CHECK_GOTO(0 == reconnect_qp(res), "failed to reconnect QPs",
+                      run_sweep_test_exit);
+    }
+    bw_params_init(&params);
+    params.opcode = point->opcode;
+    params.size = point->size;
+    params.frag_size = point->size;
+    fprintf(stderr,
+            "[Packet-%zu][sweep] %s MTU: %d, RD_ATOMIC: %d, TIMEOUT: %d, "
+            "RETRY: %d\n",
+            params.size, opcode_names[params.opcode], mtu_bytes(config.mtu),
+            config.rd_atomic, config.timeout, config.retry_cnt);
+    RDMA_CHECK_GOTO(0 == bw_run_point(res, &params, "sweep", &result),
+                    "bandwidth test failed", run_sweep_test_exit);
+    points++;
+    if (out)
+      fprintf(out, "%zu,%s,%d,%d,%d,%d,%d,%zu,%" PRIu64 ",%.3lf,%.3lf,%.1lf\n",
+              params.size, opcode_names[params.opcode], mtu_bytes(config.mtu),
+              config.rd_atomic, config.timeout, config.retry_cnt,
+              params.qdepth, result.msgs, result.ns,
+              result.ns ? (double)result.bytes / result.ns : 0.0,
+              result.ns ? result.msgs * 1e3 / result.ns : 0.0,
+              result.msgs ? (double)result.cycles / result.msgs : 0.0);
+  }
+  fprintf(stderr, "[sweep] POINTS: %d, SKIPPED: %d, TIME(s): %.3lf\n", points,
+          skipped, (get_time_ns() - t0) / 1e9);
+  rc = 0;
+
+run_sweep_test_exit:
+  if (out)
+    fclose(out);
+  return rc;
+}
+/* server side of a barrier with every client, which sync_data with it:
+ * wait for all of them to arrive, then release all of them at once */
+static int sock_barrier(const int *socks, int num) {
+  char c = 'A';
+  int i;
+  for (i = 0; i < num; ++i) {
+    if (read(socks[i], &c, 1) != 1)
+      return 1;
+  }
+  for (i = 0; i < num; ++i) {
+    if (write(socks[i], &c, 1) != 1)
+      return 1;
+  }
+  return 0;
+}
+/* accept config.clients - 1 clients besides the one connected through res,
+ * each getting a QP, and a CQ unless share_cq, on the MR of res. peers[0]
+ * is a copy of res, socks the TCP socket of every client */
+static int accept_clients(struct resources *res, struct resources *peers,
+                          int *socks, int share_cq) {
+  int listenfd = -1;
+  int i;
+  int rc = 1;
+  peers[0] = *res;
+  socks[0] = res->sock;
+  if (config.clients > 1) {
+    listenfd = sock_listen(config.tcp_port);
+    RDMA_CHECK_GOTO(listenfd >= 0, "failed to listen for more clients",
+                    accept_clients_exit);
+  }
+  for (i = 1; i < config.clients; ++i) {
+    struct resources *peer = &peers[i];
+    *peer = *res;
+    if (!share_cq) {
+      peer->cq = NULL;
+      peer->channel = NULL;
+      peer->epfd = -1;
+    }
+    peer->qp = NULL;
+    peer->sock = sock_accept(listenfd);
+    RDMA_CHECK_GOTO(peer->sock >= 0, "failed to accept client",
+                    accept_clients_exit);
+    socks[i] = peer->sock;
+    if (!share_cq)
+      RDMA_CHECK_GOTO(0 == resources_create_cq(peer),
+                      "failed to create client CQ", accept_clients_exit);
+    RDMA_CHECK_GOTO(0 == resources_create_qp(peer),
+                    "failed to create client QP", accept_clients_exit);
+    RDMA_CHECK_GOTO(0 == connect_qp(peer), "failed to connect QPs",
+                    accept_clients_exit);
+  }
+  rc = 0;
+
+accept_clients_exit:
+  if (listenfd >= 0)
+    close(listenfd);
+  return rc;
+}
+/* undo accept_clients, the resources of peers[0] stay with res */
+static void release_clients(struct resources *res, struct resources *peers) {
+  int i;
+  for (i = 1; peers && i < config.clients; ++i) {
+    /* the SRQ belongs to res */
+    peers[i].srq = NULL;
+    if (peers[i].qp)
+      resources_destroy_qp(&peers[i]);
+    if (peers[i].cq && peers[i].cq != res->cq)
+      resources_destroy_cq(&peers[i]);
+    if (peers[i].sock > 0)
+      close(peers[i].sock);
+  }
+}
+static int run_atomic_server(struct resources *res) {
+  struct resources *peers = NULL;
+  int *socks = NULL;
+  uint64_t sum = 0;
+  uint64_t expected = 0;
+  int i;
+  int rc = 1;
+
+  /* the responder side takes as many atomics in flight as it can */
+  config.rd_atomic = cap_rd_atomic(res, INT32_MAX);
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  run_atomic_server_exit);
+  memset(res->buf, 0, res->buf_size);
+  RDMA_CHECK_GOTO(0 == connect_qp(res), "failed to connect QPs",
+                  run_atomic_server_exit);
+  peers = (struct resources *)calloc(config.clients, sizeof *peers);
+  socks = (int *)calloc(config.clients, sizeof(int));
+  RDMA_CHECK_GOTO(peers && socks, "failed to allocate clients",
+                  run_atomic_server_exit);
+  /* the other clients get a CQ and QP of their own on the shared MR */
+  RDMA_CHECK_GOTO(0 == accept_clients(res, peers, socks, 0),
+                  "failed to accept clients", run_atomic_server_exit);
+  RDMA_CHECK_GOTO(0 == sock_barrier(socks, config.clients),
+                  "sync error before atomic test", run_atomic_server_exit);
+  RDMA_CHECK_GOTO(0 == sock_barrier(socks, config.clients),
+                  "sync error after atomic test", run_atomic_server_exit);
+  /* every fadd and every successful cas adds one to a slot */
+  for (i = 0; i < config.clients; ++i) {
+    uint64_t none = 0;
+    uint64_t incs;
+    RDMA_CHECK_GOTO(0 == sock_sync_data(socks[i], sizeof incs, (char *)&none,
+                                        (char *)&incs),
+                    "failed to collect the client increments",
+                    run_atomic_server_exit);
+    expected += be64toh(incs);
+  }
+  for (i = 0; i < config.slots; ++i)
+    sum += *(uint64_t *)(res->buf + (size_t)i * ATOMIC_SLOT_STRIDE);
+  fprintf(stderr, "[Packet-8][atomic] %s CLIENTS: %d, SLOTS: %d, SUM: %" PRIu64
+                  ", EXPECTED: %" PRIu64 "\n",
+          opcode_names[config.opcode], config.clients, config.slots, sum,
+          expected);
+  RDMA_CHECK_GOTO(sum == expected, "slot sum differs from the increments",
+                  run_atomic_server_exit);
+  rc = 0;
+
+run_atomic_server_exit:
+  release_clients(res, peers);
+  free(peers);
+  free(socks);
+  return rc;
+}
+static int run_atomic_client(struct resources *res) {
+  struct atomic_result result;
+  uint64_t *samples = NULL;
+  uint64_t incs;
+  uint64_t none;
+  char temp_char;
+  double sec;
+  int rc = 1;
+
+  /* the requester side keeps up to qdepth atomics in flight */
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  run_atomic_client_exit);
+  config.rd_atomic = cap_rd_atomic(res, config.qdepth);
+  RDMA_CHECK_GOTO(0 == connect_qp(res), "failed to connect QPs",
+                  run_atomic_client_exit);
+  samples = (uint64_t *)calloc(LOOP, sizeof(uint64_t));
+  RDMA_CHECK_GOTO(samples, "failed to allocate samples",
+                  run_atomic_client_exit);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "A", &temp_char),
+                  "sync error before atomic test", run_atomic_client_exit);
+  RDMA_CHECK_GOTO(0 == run_atomic(res, config.opcode, LOOP, samples, &result),
+                  "atomic test failed", run_atomic_client_exit);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "A", &temp_char),
+                  "sync error after atomic test", run_atomic_client_exit);
+  /* the increments this client made, checked against the slots */
+  incs = htobe64(config.opcode == IBV_WR_ATOMIC_CMP_AND_SWP ? result.swaps
+                                                            : result.ops);
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, sizeof incs, (char *)&incs,
+                                      (char *)&none),
+                  "failed to report the increments", run_atomic_client_exit);
+  sec = result.ns / 1e9;
+  fprintf(stderr,
+          "[Packet-8][atomic] %s QDEPTH: %d, RD_ATOMIC: %d, SLOTS: %d, "
+          "OPS: %zu, TIME(ms): %.3lf, OPS_RATE(Mops/s): %.3lf, SWAPS: %zu\n",
+          opcode_names[config.opcode], config.qdepth, config.rd_atomic,
+          config.slots, result.ops, result.ns / 1e6,
+          sec > 0 ? result.ops / sec / 1e6 : 0.0,
+          config.opcode == IBV_WR_ATOMIC_CMP_AND_SWP ? result.swaps
+                                                     : result.ops);
+  report_latency("atomic", opcode_names[config.opcode], samples, LOOP);
+  rc = 0;
+
+run_atomic_client_exit:
+  free(samples);
+  return rc;
+}
+static int run_atomic_test(struct resources *res) {
+  if (!is_atomic(config.opcode))
+    config.opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+  MSG_SIZE = sizeof(uint64_t);
+  /* the server's slots, the client's fetched values */
+  res->buf_size = (size_t)config.slots * ATOMIC_SLOT_STRIDE;
+  if (res->buf_size < config.qdepth * sizeof(uint64_t))
+    res->buf_size = config.qdepth * sizeof(uint64_t);
+  if (config.server_name)
+    return run_atomic_client(res);
+  return run_atomic_server(res);
+}
+/* value of key (e.g. "VmPin:") in /proc/self/status in kB, -1 if absent */
+static long proc_status_kb(const char *key) {
+  char line[256];
+  long kb = -1;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f)
+    return -1;
+  while (fgets(line, sizeof line, f)) {
+    if (!strncmp(line, key, strlen(key))) {
+      kb = strtol(line + strlen(key), NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+/* server side of the srq test, shared with its completion handlers */
+struct srq_server {
+  struct resources *res;
+  struct resources *peers;
+  uint32_t *qpns;   /* QP number of every peer, sorted, see srq_peer */
+  int *qpn_peer;    /* peer index of qpns[i] */
+  int slots;        /* receive buffers of MSG_SIZE at the start of buf */
+  char *reply;      /* source of the answers, after the receive buffers */
+  int *free_slots;  /* consumed receive buffers waiting for the refill */
+  int num_free;
+  size_t recvs;
+  size_t sends;
+  size_t limit_events;
+  size_t srq_posts; /* ibv_post_srq_recv calls */
+  int failed;
+};
+static struct resources *srq_peer(struct srq_server *st, uint32_t qpn) {
+  int lo = 0;
+  int hi = config.clients - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (st->qpns[mid] == qpn)
+      return &st->peers[st->qpn_peer[mid]];
+    if (st->qpns[mid] < qpn)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return NULL;
+}
+static void srq_fill_wr(struct srq_server *st, int slot, struct ibv_recv_wr *wr,
+                        struct ibv_sge *sge) {
+  memset(sge, 0, sizeof *sge);
+  sge->addr = (uintptr_t)(st->res->buf + (size_t)slot * MSG_SIZE);
+  sge->length = MSG_SIZE;
+  sge->lkey = st->res->mr->lkey;
+  memset(wr, 0, sizeof *wr);
+  wr->wr_id = MAKE_WRID(WRID_RECV, slot);
+  wr->sg_list = sge;
+  wr->num_sge = 1;
+}
+/* post every free slot to the SRQ, SRQ_POST_BATCH receives per call, and
+ * arm the limit event again */
+static int srq_refill(struct srq_server *st) {
+  struct ibv_recv_wr wrs[SRQ_POST_BATCH];
+  struct ibv_sge sges[SRQ_POST_BATCH];
+  struct ibv_recv_wr *bad_wr = NULL;
+  struct ibv_srq_attr attr;
+  while (st->num_free) {
+    int n = st->num_free < SRQ_POST_BATCH ? st->num_free : SRQ_POST_BATCH;
+    int i;
+    for (i = 0; i < n; ++i) {
+      srq_fill_wr(st, st->free_slots[st->num_free - n + i], &wrs[i], &sges[i]);
+      wrs[i].next = i + 1 < n ? &wrs[i + 1] : NULL;
+    }
+    if (ibv_post_srq_recv(st->res->srq, wrs, &bad_wr)) {
+      PRINT_ERR("failed to post %d receives to the SRQ\n", n);
+      return 1;
+    }
+    st->num_free -= n;
+    st->srq_posts++;
+  }
+  memset(&attr, 0, sizeof attr);
+  attr.srq_limit = st->slots / SRQ_LIMIT_DIV;
+  if (ibv_modify_srq(st->res->srq, &attr, IBV_SRQ_LIMIT)) {
+    PRINT_ERR("failed to arm the SRQ limit\n");
+    return 1;
+  }
+  return 0;
+}
+/* drain the async events, refilling the SRQ once it reports running low */
+static int srq_check_events(void *arg) {
+  struct srq_server *st = (struct srq_server *)arg;
+  struct ibv_async_event event;
+  int refilled = 0;
+  while (!ibv_get_async_event(st->res->ib_ctx, &event)) {
+    int type = event.event_type;
+    ibv_ack_async_event(&event);
+    if (type != IBV_EVENT_SRQ_LIMIT_REACHED) {
+      PRINT_ERR("unexpected async event %s\n", ibv_event_type_str(type));
+      continue;
+    }
+    st->limit_events++;
+    if (srq_refill(st))
+      return -1;
+    refilled = 1;
+  }
+  return refilled;
+}
+static void srq_on_recv(struct ibv_wc *wc, void *arg) {
+  struct srq_server *st = (struct srq_server *)arg;
+  struct resources *peer = srq_peer(st, wc->qp_num);
+  struct ibv_send_wr *bad_wr = NULL;
+  struct ibv_recv_wr *bad_rwr = NULL;
+  struct ibv_send_wr wr;
+  struct ibv_recv_wr rwr;
+  struct ibv_sge sge;
+  int slot = WRID_ID(wc->wr_id);
+  st->recvs++;
+  if (!peer) {
+    PRINT_ERR("receive on unknown QP 0x%x\n", wc->qp_num);
+    st->failed = 1;
+    return;
+  }
+  /* answer on the QP the message came from */
+  memset(&sge, 0, sizeof sge);
+  sge.addr = (uintptr_t)st->reply;
+  sge.length = MSG_SIZE;
+  sge.lkey = st->res->mr->lkey;
+  memset(&wr, 0, sizeof wr);
+  wr.wr_id = MAKE_WRID(WRID_SEND, 0);
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.opcode = IBV_WR_SEND;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  if (ibv_post_send(peer->qp, &wr, &bad_wr)) {
+    PRINT_ERR("failed to post the answer\n");
+    st->failed = 1;
+    return;
+  }
+  if (!st->res->srq) {
+    /* a private receive queue gets its buffer back right away */
+    srq_fill_wr(st, slot, &rwr, &sge);
+    if (ibv_post_recv(peer->qp, &rwr, &bad_rwr)) {
+      PRINT_ERR("failed to post RR\n");
+      st->failed = 1;
+    }
+    return;
+  }
+  /* the SRQ gets it back with the next refill, which is due when the limit
+   * event fires, i.e. once all but slots / SRQ_LIMIT_DIV are consumed */
+  st->free_slots[st->num_free++] = slot;
+  if (st->num_free >= st->slots - st->slots / SRQ_LIMIT_DIV &&
+      srq_check_events(st) < 0)
+    st->failed = 1;
+}
+static void srq_on_send(struct ibv_wc *wc, void *arg) {
+  (void)wc;
+  ((struct srq_server *)arg)->sends++;
+}
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+static int run_srq_server(struct resources *res) {
+  struct srq_server st;
+  struct cq_poller poller;
+  struct resources *peers = NULL;
+  int *socks = NULL;
+  size_t total = (size_t)config.clients * LOOP;
+  long pin_kb;
+  long rss_kb;
+  int flags;
+  int i;
+  int j;
+  int rc = 1;
+
+  memset(&st, 0, sizeof st);
+  memset(&poller, 0, sizeof poller);
+  st.res = res;
+  st.slots = config.srq ? config.srq : config.clients * config.qdepth;
+  res->buf_size = (size_t)(st.slots + 1) * MSG_SIZE;
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  run_srq_server_exit);
+  RDMA_CHECK_GOTO(0 == connect_qp(res), "failed to connect QPs",
+                  run_srq_server_exit);
+  st.reply = res->buf + (size_t)st.slots * MSG_SIZE;
+  peers = (struct resources *)calloc(config.clients, sizeof *peers);
+  socks = (int *)calloc(config.clients, sizeof(int));
+  st.qpns = (uint32_t *)calloc(config.clients, sizeof(uint32_t));
+  st.qpn_peer = (int *)calloc(config.clients, sizeof(int));
+  st.free_slots = (int *)calloc(st.slots, sizeof(int));
+  RDMA_CHECK_GOTO(peers && socks && st.qpns && st.qpn_peer && st.free_slots,
+                  "failed to allocate clients", run_srq_server_exit);
+  /* all clients share the CQ, and the SRQ if there is one */
+  RDMA_CHECK_GOTO(0 == accept_clients(res, peers, socks, 1),
+                  "failed to accept clients", run_srq_server_exit);
+  st.peers = peers;
+  /* completions name the QP, find the client by bisection */
+  for (i = 0; i < config.clients; ++i)
+    st.qpns[i] = peers[i].qp->qp_num;
+  qsort(st.qpns, config.clients, sizeof(uint32_t), cmp_u32);
+  for (i = 0; i < config.clients; ++i) {
+    for (j = 0; j < config.clients; ++j) {
+      if (peers[j].qp->qp_num == st.qpns[i])
+        st.qpn_peer[i] = j;
+    }
+  }
+  if (res->srq) {
+    /* limit events are picked up without blocking while polling */
+    flags = fcntl(res->ib_ctx->async_fd, F_GETFL);
+    RDMA_CHECK_GOTO(flags >= 0 && fcntl(res->ib_ctx->async_fd, F_SETFL,
+                                        flags | O_NONBLOCK) >= 0,
+                    "failed to make the async fd non-blocking",
+                    run_srq_server_exit);
+    for (i = 0; i < st.slots; ++i)
+      st.free_slots[st.num_free++] = i;
+    RDMA_CHECK_GOTO(0 == srq_refill(&st), "failed to fill the SRQ",
+                    run_srq_server_exit);
+  } else {
+    for (i = 0; i < config.clients; ++i) {
+      for (j = 0; j < config.qdepth; ++j) {
+        struct ibv_recv_wr *bad_wr = NULL;
+        struct ibv_recv_wr wr;
+        struct ibv_sge sge;
+        srq_fill_wr(&st, i * config.qdepth + j, &wr, &sge);
+        RDMA_CHECK_GOTO(0 == ibv_post_recv(peers[i].qp, &wr, &bad_wr),
+                        "failed to post RR", run_srq_server_exit);
+      }
+    }
+  }
+  pin_kb = proc_status_kb("VmPin:");
+  rss_kb = proc_status_kb("VmRSS:");
+  RDMA_CHECK_GOTO(0 == cq_poller_init(&poller, res, config.poll_batch),
+                  "failed to set up polling", run_srq_server_exit);
+  /* the async fd is only looked at while spinning */
+  poller.mode = CQ_MODE_BUSY;
+  if (res->srq) {
+    poller.idle = srq_check_events;
+    poller.idle_arg = &st;
+  }
+  cq_poller_on(&poller, WRID_RECV, srq_on_recv, &st);
+  cq_poller_on(&poller, WRID_SEND, srq_on_send, &st);
+
+  RDMA_CHECK_GOTO(0 == sock_barrier(socks, config.clients),
+                  "sync error before srq test", run_srq_server_exit);
+  while (!st.failed && (st.recvs < total || st.sends < st.recvs)) {
+    RDMA_CHECK_GOTO(cq_poller_poll(&poller) >= 0, "srq test failed",
+                    run_srq_server_exit);
+  }
+  RDMA_CHECK_GOTO(!st.failed, "srq test failed", run_srq_server_exit);
+  RDMA_CHECK_GOTO(0 == sock_barrier(socks, config.clients),
+                  "sync error after srq test", run_srq_server_exit);
+  fprintf(stderr,
+          "[Packet-%ld][%s] CLIENTS: %d, RECV_BUFS: %d, RECV_MEM(KB): %zu, "
+          "VM_PIN(KB): %ld, VM_RSS(KB): %ld, RECVS: %zu, LIMIT_EVENTS: %zu, "
+          "SRQ_POSTS: %zu\n",
+          MSG_SIZE, res->srq ? "srq" : "rq", config.clients, st.slots,
+          (size_t)st.slots * MSG_SIZE / 1024, pin_kb, rss_kb, st.recvs,
+          st.limit_events, st.srq_posts);
+  rc = 0;
+
+run_srq_server_exit:
+  cq_poller_destroy(&poller);
+  release_clients(res, peers);
+  free(peers);
+  free(socks);
+  free(st.qpns);
+  free(st.qpn_peer);
+  free(st.free_slots);
+  return rc;
+}
+static int run_srq_test(struct resources *res) {
+  uint64_t *samples = NULL;
+  int rc = 1;
+
+  /* the clients ping with SEND, the server answers every message */
+  config.opcode = IBV_WR_SEND;
+  if (!config.server_name)
+    return run_srq_server(res);
+  RDMA_CHECK_GOTO(0 == lat_setup(res, &samples), "failed to set up srq test",
+                  run_srq_test_exit);
+  RDMA_CHECK_GOTO(0 == lat_run_point(res, samples,
+                                     config.srq ? "srq" : "rq"),
+                  "latency test failed", run_srq_test_exit);
+  rc = 0;
+
+run_srq_test_exit:
+  free(samples);
+  return rc;
+}
+/* QPs of the qpscale test, all on the CQ and MR of res */
+struct qp_scale {
+  struct ibv_qp **qps;
+  struct cm_con_data_t *remote; /* host order */
+  int num;
+};
+/* connection record of one of our QPs, network order */
+static void qps_local_record(struct resources *res, struct ibv_qp *qp,
+                             const union ibv_gid *gid,
+                             struct cm_con_data_t *rec) {
+  rec->addr = htonll((uintptr_t)res->buf);
+  rec->rkey = htonl(res->mr->rkey);
+  rec->qp_num = htonl(qp->qp_num);
+  rec->lid = htons(res->port_attr.lid);
+  memcpy(rec->gid, gid, 16);
+}
+/* create QPs num .. target - 1 and connect them with one sock_exchange of
+ * all their records and a single barrier once all of them are in RTS;
+ * t[0] .. t[3] are the start and the ends of creation, exchange and
+ * connection */
+static int qps_connect_batch(struct resources *res, struct qp_scale *st,
+                             int target, const union ibv_gid *gid,
+                             uint64_t t[4]) {
+  struct cm_con_data_t *local = NULL;
+  struct cm_con_data_t *remote = NULL;
+  uint32_t remote_count = 0;
+  char temp_char;
+  int n = target - st->num;
+  int i;
+  int rc = 1;
+
+  local = (struct cm_con_data_t *)calloc(n, sizeof *local);
+  RDMA_CHECK_GOTO(local, "failed to allocate connection records",
+                  qps_connect_batch_exit);
+  t[0] = get_time_ns();
+  for (; st->num < target; ++st->num) {
+    st->qps[st->num] = create_qp(res);
+    RDMA_CHECK_GOTO(st->qps[st->num], "failed to create QP",
+                    qps_connect_batch_exit);
+  }
+  t[1] = get_time_ns();
+  for (i = 0; i < n; ++i)
+    qps_local_record(res, st->qps[target - n + i], gid, &local[i]);
+  RDMA_CHECK_GOTO(0 == sock_exchange(res->sock, local, n, sizeof *local,
+                                     (uint32_t)config.qps, (void **)&remote,
+                                     &remote_count),
+                  "failed to exchange connection data between sides",
+                  qps_connect_batch_exit);
+  /* both sides have to grow by the same number of QPs */
+  RDMA_CHECK_GOTO(remote_count == (uint32_t)n,
+                  "both sides have to pass the same -N",
+                  qps_connect_batch_exit);
+  t[2] = get_time_ns();
+  for (i = 0; i < n; ++i) {
+    struct cm_con_data_t *r = &st->remote[target - n + i];
+    struct ibv_qp *qp = st->qps[target - n + i];
+    r->addr = ntohll(remote[i].addr);
+    r->rkey = ntohl(remote[i].rkey);
+    r->qp_num = ntohl(remote[i].qp_num);
+    r->lid = ntohs(remote[i].lid);
+    memcpy(r->gid, remote[i].gid, 16);
+    RDMA_CHECK_GOTO(0 == modify_qp_to_init(qp),
+                    "change QP state to INIT failed", qps_connect_batch_exit);
+    RDMA_CHECK_GOTO(0 == modify_qp_to_rtr(qp, r->qp_num, r->lid, r->gid),
+                    "failed to modify QP state to RTR",
+                    qps_connect_batch_exit);
+    RDMA_CHECK_GOTO(0 == modify_qp_to_rts(qp),
+                    "failed to modify QP state to RTS",
+                    qps_connect_batch_exit);
+  }
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "Q", &temp_char),
+                  "sync error after QPs are were moved to RTS",
+                  qps_connect_batch_exit);
+  t[3] = get_time_ns();
+  rc = 0;
+
+qps_connect_batch_exit:
+  free(remote);
+  free(local);
+  return rc;
+}
+/* create QPs num .. target - 1 and connect them one by one with connect_qp,
+ * two round trips each */
+static int qps_connect_serial(struct resources *res, struct qp_scale *st,
+                              int target) {
+  int rc = 0;
+  for (; st->num < target && !rc; ++st->num) {
+    st->qps[st->num] = create_qp(res);
+    if (!st->qps[st->num])
+      return 1;
+    res->qp = st->qps[st->num];
+    rc = connect_qp(res);
+    st->remote[st->num] = res->remote_props;
+    res->qp = NULL;
+  }
+  return rc;
+}
+static int qps_destroy(struct qp_scale *st) {
+  int rc = 0;
+  int ret;
+  while (st->num > 0) {
+    struct ibv_qp *qp = st->qps[--st->num];
+    if (!qp)
+      continue;
+    LOG_TIME(ret = ibv_destroy_qp(qp), "ibv_destroy_qp");
+    if (ret) {
+      PRINT_ERR("failed to destroy QP %d\n", st->num);
+      rc = 1;
+    }
+  }
+  return rc;
+}
+/* create and connect QPs num .. target - 1 and report the cost */
+static int qpscale_grow(struct resources *res, struct qp_scale *st,
+                        int target, const union ibv_gid *gid) {
+  uint64_t t[4];
+  long rss_kb = proc_status_kb("VmRSS:");
+  long pin_kb = proc_status_kb("VmPin:");
+  int n = target - st->num;
+
+  if (qps_connect_batch(res, st, target, gid, t))
+    return 1;
+  fprintf(stderr,
+          "[Packet-%zu][qpscale] QPS: %d, NEW: %d, CREATE(ms): %.3lf, "
+          "EXCHANGE(ms): %.3lf, CONNECT(ms): %.3lf, QPS/S: %.0lf, "
+          "RSS_KB/QP: %.2lf, PIN_KB/QP: %.2lf\n",
+          MSG_SIZE, target, n, (t[1] - t[0]) / 1e6, (t[2] - t[1]) / 1e6,
+          (t[3] - t[2]) / 1e6, n / ((t[3] - t[0]) / 1e9),
+          (double)(proc_status_kb("VmRSS:") - rss_kb) / n,
+          (double)(proc_status_kb("VmPin:") - pin_kb) / n);
+  return 0;
+}
+static void qpscale_on_send(struct ibv_wc *wc, void *arg) {
+  (void)wc;
+  (*(size_t *)arg)++;
+}
+/* the client keeps qdepth WRs in flight in total, WR i going to QP i % num,
+ * so that no QP ever holds more than its send queue */
+static int qpscale_traffic(struct resources *res, struct qp_scale *st) {
+  struct ibv_send_wr *bad_wr = NULL;
+  struct ibv_send_wr wr;
+  struct ibv_sge sge;
+  struct cq_poller poller;
+  size_t posted = 0;
+  size_t completed = 0;
+  uint64_t t0;
+  uint64_t ns;
+  char temp_char;
+  int rc = 1;
+
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "B", &temp_char),
+                  "sync error before qpscale traffic", qpscale_traffic_exit);
+  if (config.server_name) {
+    if (cq_poller_init(&poller, res, config.poll_batch))
+      goto qpscale_traffic_exit;
+    cq_poller_on(&poller, WRID_SEND, qpscale_on_send, &completed);
+    memset(&wr, 0, sizeof wr);
+    sge.addr = (uintptr_t)res->buf;
+    sge.length = MSG_SIZE;
+    sge.lkey = res->mr->lkey;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = config.opcode;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    t0 = get_time_ns();
+    while (completed < LOOP) {
+      while (posted < LOOP && posted - completed < (size_t)config.qdepth) {
+        int q = posted % st->num;
+        wr.wr_id = MAKE_WRID(WRID_SEND, posted);
+        wr.wr.rdma.remote_addr = st->remote[q].addr;
+        wr.wr.rdma.rkey = st->remote[q].rkey;
+        if (ibv_post_send(st->qps[q], &wr, &bad_wr)) {
+          PRINT_ERR("failed to post WR %zu on QP %d\n", posted, q);
+          cq_poller_destroy(&poller);
+          goto qpscale_traffic_exit;
+        }
+        posted++;
+      }
+      if (cq_poller_poll(&poller) < 0) {
+        cq_poller_destroy(&poller);
+        goto qpscale_traffic_exit;
+      }
+    }
+    ns = get_time_ns() - t0;
+    cq_poller_destroy(&poller);
+    fprintf(stderr,
+            "[Packet-%zu][qpscale] %s QPS: %d, MSGS: %zu, TIME(ms): %.3lf, "
+            "BW(GB/s): %.3lf, MSG_RATE(Mmsg/s): %.3lf\n",
+            MSG_SIZE, opcode_names[config.opcode], st->num, completed,
+            ns / 1e6, completed * MSG_SIZE / (ns / 1e9) / 1e9,
+            completed / (ns / 1e9) / 1e6);
+  }
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "E", &temp_char),
+                  "sync error after qpscale traffic", qpscale_traffic_exit);
+  rc = 0;
+
+qpscale_traffic_exit:
+  return rc;
+}
+/* the QP table of config.qps entries and the shared resources, device, PD,
+ * CQ and MR, with the QP of res itself destroyed again */
+static int qps_setup(struct resources *res, struct qp_scale *st,
+                     union ibv_gid *gid) {
+  memset(st, 0, sizeof *st);
+  st->qps = (struct ibv_qp **)calloc(config.qps, sizeof *st->qps);
+  st->remote =
+      (struct cm_con_data_t *)calloc(config.qps, sizeof *st->remote);
+  RDMA_CHECK_GOTO(st->qps && st->remote, "failed to allocate QP table",
+                  qps_setup_exit);
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  qps_setup_exit);
+  RDMA_CHECK_GOTO(0 == resources_release(res, RES_LEVEL_MR),
+                  "failed to destroy the QP", qps_setup_exit);
+  if (config.opcode == IBV_WR_RDMA_READ) {
+    config.rd_atomic = cap_rd_atomic(res, config.qdepth);
+  }
+  memset(gid, 0, sizeof *gid);
+  if (config.gid_idx >= 0)
+    RDMA_CHECK_GOTO(0 == ibv_query_gid(res->ib_ctx, config.ib_port,
+                                       config.gid_idx, gid),
+                    "could not get gid", qps_setup_exit);
+  return 0;
+
+qps_setup_exit:
+  return 1;
+}
+static int run_qpscale_test(struct resources *res) {
+  struct qp_scale st;
+  union ibv_gid gid;
+  int target;
+  int rc = 1;
+
+  /* the passive side has no receives to keep up, SEND is not supported */
+  if (config.opcode != IBV_WR_RDMA_WRITE && config.opcode != IBV_WR_RDMA_READ) {
+    PRINT_ERR("the qpscale test runs write or read only\n");
+    return 1;
+  }
+  RDMA_CHECK_GOTO(0 == qps_setup(res, &st, &gid), "failed to set up QPs",
+                  run_qpscale_test_exit);
+  for (target = 1;; target = target * 2 < config.qps ? target * 2
+                                                     : config.qps) {
+    RDMA_CHECK_GOTO(0 == qpscale_grow(res, &st, target, &gid),
+                    "failed to connect QPs", run_qpscale_test_exit);
+    RDMA_CHECK_GOTO(0 == qpscale_traffic(res, &st), "qpscale traffic failed",
+                    run_qpscale_test_exit);
+    if (target == config.qps)
+      break;
+  }
+  rc = 0;
+
+run_qpscale_test_exit:
+  if (st.qps)
+    rc |= qps_destroy(&st);
+  free(st.remote);
+  free(st.qps);
+  return rc;
+}
+static int run_exchange_test(struct resources *res) {
+  struct qp_scale st;
+  union ibv_gid gid;
+  uint64_t t[4];
+  uint64_t serial_ns;
+  int target;
+  int rc = 1;
+
+  RDMA_CHECK_GOTO(0 == qps_setup(res, &st, &gid), "failed to set up QPs",
+                  run_exchange_test_exit);
+  for (target = 1;; target = target * 2 < config.qps ? target * 2
+                                                     : config.qps) {
+    t[0] = get_time_ns();
+    RDMA_CHECK_GOTO(0 == qps_connect_serial(res, &st, target),
+                    "failed to connect QPs one by one",
+                    run_exchange_test_exit);
+    serial_ns = get_time_ns() - t[0];
+    RDMA_CHECK_GOTO(0 == qps_destroy(&st), "failed to destroy QPs",
+                    run_exchange_test_exit);
+    RDMA_CHECK_GOTO(0 == qps_connect_batch(res, &st, target, &gid, t),
+                    "failed to connect QPs in a batch",
+                    run_exchange_test_exit);
+    RDMA_CHECK_GOTO(0 == qps_destroy(&st), "failed to destroy QPs",
+                    run_exchange_test_exit);
+    fprintf(stderr,
+            "[Packet-%zu][exchange] CONNS: %d, SERIAL(ms): %.3lf, "
+            "BATCH(ms): %.3lf, BATCH_EXCHANGE(ms): %.3lf, SERIAL_RTTS: %d, "
+            "BATCH_RTTS: 2, SPEEDUP: %.2lf\n",
+            MSG_SIZE, target, serial_ns / 1e6, (t[3] - t[0]) / 1e6,
+            (t[2] - t[1]) / 1e6, 2 * target,
+            (double)serial_ns / (t[3] - t[0]));
+    if (target == config.qps)
+      break;
+  }
+  rc = 0;
+
+run_exchange_test_exit:
+  if (st.qps)
+    rc |= qps_destroy(&st);
+  free(st.remote);
+  free(st.qps);
+  return rc;
+}
+#ifdef LOG_TO_FILE
+static struct hist hists[HIST_MAX];
+static int hist_num;
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int hist_bucket(uint64_t ns) {
+  int shift;
+  if (ns < (2 << HIST_SUB_BITS))
+    return ns;
+  shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+  if (shift > HIST_RANGE_BITS - 1 - HIST_SUB_BITS)
+    return HIST_BUCKETS - 1;
+  return ((shift + 1) << HIST_SUB_BITS) +
+         (int)(ns >> shift) - (1 << HIST_SUB_BITS);
+}
+/* midpoint of the values falling into bucket idx */
+static double hist_value(int idx) {
+  int shift = (idx >> HIST_SUB_BITS) - 1;
+  uint64_t low;
+  if (shift <= 0)
+    return idx;
+  low = (uint64_t)((1 << HIST_SUB_BITS) + (idx & ((1 << HIST_SUB_BITS) - 1)))
+        << shift;
+  return low + ((1ULL << shift) - 1) / 2.0;
+}
+static struct hist *hist_find(const char *name, size_t size, int num) {
+  int i;
+  for (i = 0; i < num; ++i) {
+    if (hists[i].size == size &&
+        (hists[i].name == name || !strcmp(hists[i].name, name)))
+      return &hists[i];
+  }
+  return NULL;
+}
+static void hist_record(const char *name, size_t size, uint64_t ns) {
+  struct hist *h =
+      hist_find(name, size, __atomic_load_n(&hist_num, __ATOMIC_ACQUIRE));
+  uint64_t v;
+  if (!h) {
+    pthread_mutex_lock(&hist_lock);
+    h = hist_find(name, size, hist_num);
+    if (!h && hist_num < HIST_MAX) {
+      h = &hists[hist_num];
+      h->name = name;
+      h->size = size;
+      h->min = UINT64_MAX;
+      __atomic_store_n(&hist_num, hist_num + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&hist_lock);
+    if (!h)
+      return;
+  }
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+  v = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+  while (ns < v && !__atomic_compare_exchange_n(&h->min, &v, ns, 1,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED))
+    ;
+  v = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+  while (ns > v && !__atomic_compare_exchange_n(&h->max, &v, ns, 1,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED))
+    ;
+}
+/* smallest bucket value with at least p of the samples at or below it */
+static double hist_percentile(const struct hist *h, double p) {
+  uint64_t rank = (uint64_t)(p * h->count);
+  uint64_t seen = 0;
+  int i;
+  for (i = 0; i < HIST_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen > rank)
+      break;
+  }
+  if (i == HIST_BUCKETS || hist_value(i) > h->max)
+    return h->max;
+  return hist_value(i);
+}
+static void hist_dump(void) {
+  int n = __atomic_load_n(&hist_num, __ATOMIC_ACQUIRE);
+  int i;
+  int j;
+  for (i = 0; i < n; ++i) {
+    const struct hist *h = &hists[i];
+    double mean;
+    double var = 0;
+    if (!h->count)
+      continue;
+    mean = (double)h->sum / h->count;
+    for (j = 0; j < HIST_BUCKETS; ++j) {
+      double d = hist_value(j) - mean;
+      var += h->buckets[j] * d * d;
+    }
+    fprintf(stdout,
+            "HIST %s %zu COUNT %" PRIu64 " SUM %" PRIu64 " MIN %" PRIu64
+            " MAX %" PRIu64 " MEAN %.1f STDDEV %.1f P50 %.0f P90 %.0f"
+            " P99 %.0f P99.9 %.0f SUB_BITS %d BUCKETS",
+            h->name, h->size, h->count, h->sum, h->min, h->max, mean,
+            sqrt(var / h->count), hist_percentile(h, 0.5),
+            hist_percentile(h, 0.9), hist_percentile(h, 0.99),
+            hist_percentile(h, 0.999), HIST_SUB_BITS);
+    for (j = 0; j < HIST_BUCKETS; ++j) {
+      if (h->buckets[j])
+        fprintf(stdout, " %d:%" PRIu64, j, h->buckets[j]);
+    }
+    fprintf(stdout, "\n");
+  }
+  fflush(stdout);
+}
+#endif
+static const char *record_verbs[RECORD_VERBS_MAX];
+static int record_num_verbs;
+static int record_threads;
+static pthread_key_t record_key;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void record_flush(struct record_buf *buf) {
+  size_t len = buf->num * sizeof(struct record);
+  if (len && write(record_fd, buf->recs, len) != (ssize_t)len)
+    PRINT_ERR("failed to write %d records\n", buf->num);
+  buf->num = 0;
+}
+/* pthread key destructor, runs when a recording thread exits */
+static void record_buf_free(void *arg) {
+  struct record_buf *buf = (struct record_buf *)arg;
+  record_flush(buf);
+  free(buf);
+}
+static int record_verb(const char *name) {
+  int n = __atomic_load_n(&record_num_verbs, __ATOMIC_ACQUIRE);
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (record_verbs[i] == name || !strcmp(record_verbs[i], name))
+      return i;
+  }
+  pthread_mutex_lock(&record_lock);
+  for (i = 0; i < record_num_verbs; ++i) {
+    if (!strcmp(record_verbs[i], name))
+      break;
+  }
+  if (i == record_num_verbs && i < RECORD_VERBS_MAX) {
+    record_verbs[i] = name;
+    __atomic_store_n(&record_num_verbs, i + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&record_lock);
+  return i < RECORD_VERBS_MAX ? i : -1;
+}
+static void record_sample(const char *name, uint64_t ns) {
+  struct record_buf *buf =
+      (struct record_buf *)pthread_getspecific(record_key);
+  struct record *rec;
+  int verb = record_verb(name);
+  if (verb < 0)
+    return;
+  if (!buf) {
+    buf = (struct record_buf *)calloc(1, sizeof *buf);
+    if (!buf)
+      return;
+    buf->thread = __atomic_fetch_add(&record_threads, 1, __ATOMIC_RELAXED);
+    pthread_setspecific(record_key, buf);
+  }
+  if (buf->size != MSG_SIZE) {
+    buf->size = MSG_SIZE;
+    memset(buf->iters, 0, sizeof buf->iters);
+  }
+  rec = &buf->recs[buf->num++];
+  rec->size = MSG_SIZE;
+  rec->ns = ns;
+  rec->iter = buf->iters[verb]++;
+  rec->qp = record_qp;
+  rec->verb = verb;
+  rec->thread = buf->thread;
+  rec->reserved = 0;
+  if (buf->num == RECORD_BUF)
+    record_flush(buf);
+}
+#define RECORD_FIELD(f)                                                     \
+  { #f, offsetof(struct record, f), sizeof(((struct record *)0)->f) }
+static int record_open(const char *path) {
+  struct record_hdr hdr = {
+      RECORD_MAGIC, RECORD_VERSION, sizeof(struct record_hdr),
+      sizeof(struct record), 6, 0,
+      {RECORD_FIELD(size), RECORD_FIELD(ns), RECORD_FIELD(iter),
+       RECORD_FIELD(qp), RECORD_FIELD(verb), RECORD_FIELD(thread)}};
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0) {
+    PRINT_ERR("failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  if (write(fd, &hdr, sizeof hdr) != sizeof hdr ||
+      pthread_key_create(&record_key, record_buf_free)) {
+    PRINT_ERR("failed to set up %s\n", path);
+    close(fd);
+    return 1;
+  }
+  record_fd = fd;
+  atexit(record_close);
+  return 0;
+}
+static void record_close(void) {
+  struct record_buf *buf =
+      (struct record_buf *)pthread_getspecific(record_key);
+  uint32_t n = record_num_verbs;
+  off_t off;
+  uint32_t i;
+  int fd = record_fd;
+  if (buf) {
+    record_flush(buf);
+    free(buf);
+    pthread_setspecific(record_key, NULL);
+  }
+  record_fd = -1;
+  off = lseek(fd, 0, SEEK_END);
+  if (write(fd, &n, sizeof n) != sizeof n)
+    goto record_close_exit;
+  for (i = 0; i < n; ++i) {
+    size_t len = strlen(record_verbs[i]) + 1;
+    if (write(fd, record_verbs[i], len) != (ssize_t)len)
+      goto record_close_exit;
+  }
+  /* on Linux pwrite appends to an O_APPEND file, drop it to patch the
+   * header in place */
+  if (fcntl(fd, F_SETFL, 0) ||
+      pwrite(fd, &(uint64_t){off}, sizeof(uint64_t),
+             offsetof(struct record_hdr, names_offset)) != sizeof(uint64_t))
+    goto record_close_exit;
+  close(fd);
+  return;
+record_close_exit:
+  PRINT_ERR("failed to write the verb names of the record file\n");
+  close(fd);
+}
+
+static void verb_sink_add(struct verb_sink *sink, const char *name,
+                          uint64_t ns) {
+  struct verb_stat *stat;
+  int i;
+  for (i = 0; i < sink->num; ++i) {
+    if (!strcmp(sink->verbs[i].name, name))
+      break;
+  }
+  if (i == sink->num) {
+    if (sink->num == VERB_SINK_MAX)
+      return;
+    sink->verbs[sink->num++].name = name;
+  }
+  stat = &sink->verbs[i];
+  if (stat->num == stat->cap) {
+    size_t cap = stat->cap ? 2 * stat->cap : 256;
+    uint64_t *samples =
+        (uint64_t *)realloc(stat->samples, cap * sizeof *samples);
+    if (!samples)
+      return;
+    stat->samples = samples;
+    stat->cap = cap;
+  }
+  stat->samples[stat->num++] = ns;
+}
+static void verb_sink_free(struct verb_sink *sink) {
+  int i;
+  for (i = 0; i < sink->num; ++i)
+    free(sink->verbs[i].samples);
+  memset(sink, 0, sizeof *sink);
+}
+/* print the percentiles of every verb over the sinks of num threads */
+static void report_verb_sinks(const char *tag, struct setup_thread *threads,
+                              int num) {
+  uint64_t *samples;
+  size_t n;
+  int v;
+  int i;
+  int j;
+  for (v = 0; v < threads[0].sink.num; ++v) {
+    const char *name = threads[0].sink.verbs[v].name;
+    n = 0;
+    for (i = 0; i < num; ++i) {
+      for (j = 0; j < threads[i].sink.num; ++j) {
+        if (!strcmp(threads[i].sink.verbs[j].name, name))
+          n += threads[i].sink.verbs[j].num;
+      }
+    }
+    samples = (uint64_t *)malloc(n * sizeof *samples);
+    if (!samples)
+      return;
+    n = 0;
+    for (i = 0; i < num; ++i) {
+      for (j = 0; j < threads[i].sink.num; ++j) {
+        struct verb_stat *stat = &threads[i].sink.verbs[j];
+        if (strcmp(stat->name, name))
+          continue;
+        memcpy(samples + n, stat->samples, stat->num * sizeof *samples);
+        n += stat->num;
+      }
+    }
+    report_latency(tag, name, samples, n);
+    free(samples);
+  }
+}
+static void *setup_thread_main(void *arg) {
+  struct setup_thread *t = (struct setup_thread *)arg;
+  size_t i;
+  int level;
+  verb_sink = &t->sink;
+  for (i = 0; i < LOOP && !t->rc; ++i) {
+    for (level = RES_LEVEL_PD + 1; level < RES_LEVEL_NUM && !t->rc; ++level)
+      t->rc = res_levels[level].create(&t->res);
+    if (!t->rc)
+      t->rc = connect_qp(&t->res);
+    t->rc |= resources_release(&t->res, RES_LEVEL_PD);
+  }
+  verb_sink = NULL;
+  return NULL;
+}
+/* one TCP connection per worker, the first one is res->sock */
+static int setup_thread_socks(struct resources *res,
+                              struct setup_thread *threads) {
+  int listenfd = -1;
+  char temp_char;
+  int i;
+  int rc = 1;
+  if (!config.server_name) {
+    listenfd = sock_listen(config.tcp_port);
+    RDMA_CHECK_GOTO(listenfd >= 0, "failed to listen for worker connections",
+                    setup_thread_socks_exit);
+  }
+  /* the client connects only once the server listens */
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "L", &temp_char),
+                  "sync error before worker connections",
+                  setup_thread_socks_exit);
+  for (i = 1; i < config.threads; ++i) {
+    if (config.server_name)
+      threads[i].res.sock = sock_connect(config.server_name, config.tcp_port);
+    else
+      threads[i].res.sock = sock_accept(listenfd);
+    RDMA_CHECK_GOTO(threads[i].res.sock >= 0,
+                    "failed to open worker connection",
+                    setup_thread_socks_exit);
+  }
+  rc = 0;
+
+setup_thread_socks_exit:
+  if (listenfd >= 0)
+    close(listenfd);
+  return rc;
+}
+static int run_mtsetup_test(struct resources *res) {
+  struct setup_thread *threads = NULL;
+  pthread_attr_t attr;
+  double base_rate = 0;
+  uint64_t t0;
+  uint64_t ns;
+  char temp_char;
+  char tag[32];
+  int num;
+  int i;
+  int rc = 1;
+
+  if (config.reg_cache) {
+    PRINT_ERR("the registration cache is not shared between threads\n");
+    return 1;
   }
-  if (res->pd) {
-    int ret;
-    LOG_TIME_CHECK(ret = ibv_dealloc_pd(res->pd), "ibv_dealloc_pd", ret == 0);
+  RDMA_CHECK_GOTO(0 == resources_create_device(res),
+                  "failed to open the device", run_mtsetup_test_exit);
+  RDMA_CHECK_GOTO(0 == resources_create_pd(res), "failed to allocate the PD",
+                  run_mtsetup_test_exit);
+  threads = (struct setup_thread *)calloc(config.threads, sizeof *threads);
+  RDMA_CHECK_GOTO(threads, "failed to allocate threads",
+                  run_mtsetup_test_exit);
+  for (i = 0; i < config.threads; ++i) {
+    threads[i].cpu = thread_cpu(i);
+    threads[i].res = *res;
+    threads[i].res.sock = i ? -1 : res->sock;
   }
-  if (res->ib_ctx) {
-    int ret;
-    LOG_TIME_CHECK(ret = ibv_close_device(res->ib_ctx), "ibv_close_device",
-                   ret == 0);
+  RDMA_CHECK_GOTO(0 == setup_thread_socks(res, threads),
+                  "failed to connect the workers", run_mtsetup_test_exit);
+
+  for (num = 1;; num = num * 2 < config.threads ? num * 2 : config.threads) {
+    RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "B", &temp_char),
+                    "sync error before setup round", run_mtsetup_test_exit);
+    t0 = get_time_ns();
+    for (i = 0; i < num; ++i) {
+      thread_attr_init(&attr, threads[i].cpu);
+      threads[i].rc = pthread_create(&threads[i].thread, &attr,
+                                     setup_thread_main, &threads[i]);
+      pthread_attr_destroy(&attr);
+      if (threads[i].rc) {
+        PRINT_ERR("failed to start thread %d\n", i);
+        num = i;
+        break;
+      }
+    }
+    for (i = 0; i < num; ++i)
+      pthread_join(threads[i].thread, NULL);
+    ns = get_time_ns() - t0;
+    RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "E", &temp_char),
+                    "sync error after setup round", run_mtsetup_test_exit);
+    for (i = 0; i < num; ++i)
+      RDMA_CHECK_GOTO(0 == threads[i].rc, "setup round failed",
+                      run_mtsetup_test_exit);
+    snprintf(tag, sizeof tag, "mtsetup-t%d", num);
+    report_verb_sinks(tag, threads, num);
+    if (num == 1)
+      base_rate = LOOP / (ns / 1e9);
+    fprintf(stderr,
+            "[Packet-%zu][mtsetup] THREADS: %d, SETUPS: %zu, TIME(ms): %.3lf, "
+            "SETUPS/S: %.1lf, EFFICIENCY: %.3lf\n",
+            MSG_SIZE, num, num * LOOP, ns / 1e6, num * LOOP / (ns / 1e9),
+            base_rate > 0 ? num * LOOP / (ns / 1e9) / (num * base_rate)
+                          : 0.0);
+    for (i = 0; i < num; ++i)
+      verb_sink_free(&threads[i].sink);
+    if (num == config.threads)
+      break;
   }
+  rc = 0;
+
+run_mtsetup_test_exit:
+  for (i = 0; threads && i < config.threads; ++i) {
+    verb_sink_free(&threads[i].sink);
+    if (i && threads[i].res.sock >= 0)
+      close(threads[i].res.sock);
+  }
+  free(threads);
   return rc;
 }
-static int sock_destroy(struct resources *res) {
-  int rc = 0;
-  if (res->sock >= 0) {
-    RDMA_CHECK(0 == close(res->sock), "failed to close socket");
+static int run_transport_test(struct resources *res) {
+  static const int transports[] = {IBV_QPT_RC, IBV_QPT_UD};
+  static const char *names[] = {"rc", "ud"};
+  struct bw_params params;
+  struct bw_result result[2];
+  uint64_t p50[2];
+  uint64_t *samples = NULL;
+  char tag[16];
+  int i;
+  int rc = 1;
+
+  /* UD carries sends only */
+  config.opcode = IBV_WR_SEND;
+  samples = (uint64_t *)calloc(LOOP, sizeof(uint64_t));
+  RDMA_CHECK_GOTO(samples, "failed to allocate samples",
+                  run_transport_test_exit);
+  for (i = 0; i < 2; ++i) {
+    config.transport = transports[i];
+    /* receive half followed by send half, as in the lat test */
+    res->buf_size = 2 * MSG_SIZE;
+    RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                    run_transport_test_exit);
+    RDMA_CHECK_GOTO(0 == connect_qp(res), "failed to connect QPs",
+                    run_transport_test_exit);
+    snprintf(tag, sizeof tag, "lat-%s", names[i]);
+    RDMA_CHECK_GOTO(0 == lat_run_point(res, samples, tag),
+                    "latency test failed", run_transport_test_exit);
+    /* report_latency left the samples sorted */
+    p50[i] = samples[LOOP / 2];
+    snprintf(tag, sizeof tag, "bw-%s", names[i]);
+    bw_params_init(&params);
+    RDMA_CHECK_GOTO(0 == bw_run_point(res, &params, tag, &result[i]),
+                    "bandwidth test failed", run_transport_test_exit);
+    /* the MR goes too, its size depends on the transport */
+    RDMA_CHECK_GOTO(0 == resources_release(res, RES_LEVEL_PD),
+                    "failed to release resources", run_transport_test_exit);
+  }
+  if (config.server_name)
+    fprintf(stderr,
+            "[Packet-%zu][transport] P50(us) RC: %.3lf, UD: %.3lf, "
+            "MSG_RATE(Mmsg/s) RC: %.3lf, UD: %.3lf\n",
+            MSG_SIZE, p50[0] / 1000.0, p50[1] / 1000.0,
+            result[0].ns ? result[0].msgs * 1e3 / result[0].ns : 0.0,
+            result[1].ns ? result[1].msgs * 1e3 / result[1].ns : 0.0);
+  rc = 0;
+
+run_transport_test_exit:
+  free(samples);
+  return rc;
+}
+static void report_connect(const char *backend, uint64_t *samples,
+                           uint64_t ns) {
+  char tag[32];
+  snprintf(tag, sizeof tag, "connect-%s", backend);
+  report_latency(tag, "connect", samples, LOOP);
+  fprintf(stderr,
+          "[Packet-%zu][%s] CONNS: %zu, TIME(ms): %.3lf, CONN/S: %.1lf\n",
+          MSG_SIZE, tag, LOOP, ns / 1e6, LOOP / (ns / 1e9));
+}
+/* QP creation, TCP exchange and the manual INIT/RTR/RTS transitions; the
+ * socket itself stays, as it would for a reconnect */
+static int connect_tcp_run(struct resources *res, uint64_t *samples,
+                           uint64_t *ns) {
+  uint64_t start = get_time_ns();
+  uint64_t t0;
+  size_t i;
+  for (i = 0; i < LOOP; ++i) {
+    t0 = get_time_ns();
+    if (resources_create(res) || connect_qp(res))
+      return 1;
+    samples[i] = get_time_ns() - t0;
+    if (resources_release(res, RES_LEVEL_MR))
+      return 1;
+  }
+  *ns = get_time_ns() - start;
+  return 0;
+}
+#ifdef HAVE_RDMACM
+/* rdma_cm state of the connect test */
+struct cm_backend {
+  struct rdma_event_channel *channel;
+  struct rdma_cm_id *listen_id;       /* server only */
+  struct sockaddr_storage dst;        /* client only */
+  struct ibv_context *ctx;            /* device rdma_cm resolved to */
+  struct ibv_pd *pd;
+  struct ibv_cq *cq;
+};
+/* wait for the next event, which has to be of type */
+static int cm_wait(struct cm_backend *cm, enum rdma_cm_event_type type,
+                   struct rdma_cm_id **id) {
+  struct rdma_cm_event *event;
+  int rc;
+  if (rdma_get_cm_event(cm->channel, &event)) {
+    PRINT_ERR("rdma_get_cm_event failed: %s\n", strerror(errno));
+    return 1;
+  }
+  rc = event->event != type;
+  if (rc)
+    PRINT_ERR("got %s (status %d) instead of %s\n",
+              rdma_event_str(event->event), event->status,
+              rdma_event_str(type));
+  else if (id)
+    *id = event->id;
+  rdma_ack_cm_event(event);
+  return rc;
+}
+/* the QPs need a PD and CQ of the context rdma_cm hands out, which is not
+ * the one of ibv_open_device; both are created with the first connection */
+static int cm_verbs(struct cm_backend *cm, struct rdma_cm_id *id) {
+  if (cm->ctx == id->verbs)
+    return 0;
+  if (cm->ctx) {
+    PRINT_ERR("rdma_cm resolved to another device\n");
+    return 1;
+  }
+  cm->ctx = id->verbs;
+  cm->pd = ibv_alloc_pd(cm->ctx);
+  if (cm->pd)
+    cm->cq = ibv_create_cq(cm->ctx, 2 * config.qdepth, NULL, NULL, 0);
+  if (!cm->cq) {
+    PRINT_ERR("failed to create PD and CQ for rdma_cm\n");
+    return 1;
+  }
+  return 0;
+}
+static int cm_create_qp(struct resources *res, struct cm_backend *cm,
+                        struct rdma_cm_id *id) {
+  struct ibv_qp_init_attr attr;
+  int rc;
+  if (cm_verbs(cm, id) || fill_qp_init_attr(res, &attr))
+    return 1;
+  attr.send_cq = cm->cq;
+  attr.recv_cq = cm->cq;
+  attr.srq = NULL;
+  LOG_TIME(rc = rdma_create_qp(id, cm->pd, &attr), "rdma_create_qp");
+  if (rc)
+    PRINT_ERR("rdma_create_qp failed: %s\n", strerror(errno));
+  return rc != 0;
+}
+static void cm_conn_param(struct rdma_conn_param *param) {
+  memset(param, 0, sizeof *param);
+  param->responder_resources = config.rd_atomic;
+  param->initiator_depth = config.rd_atomic;
+  param->retry_count = config.retry_cnt;
+  /* retry forever on RNR, like modify_qp_to_rts */
+  param->rnr_retry_count = 7;
+}
+static void cm_destroy_id(struct rdma_cm_id *id) {
+  if (id->qp)
+    rdma_destroy_qp(id);
+  rdma_destroy_id(id);
+}
+/* server: bind and listen; client: resolve the server's address */
+static int cm_init(struct cm_backend *cm) {
+  struct addrinfo *resolved_addr = NULL;
+  struct addrinfo hints;
+  char service[6];
+  int rc;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (!config.server_name)
+    hints.ai_flags = AI_PASSIVE;
+  snprintf(service, sizeof service, "%d", config.tcp_port + CM_PORT_OFFSET);
+  rc = getaddrinfo(config.server_name, service, &hints, &resolved_addr);
+  if (rc) {
+    PRINT_ERR("%s for %s:%s\n", gai_strerror(rc), config.server_name, service);
+    return 1;
+  }
+  rc = 1;
+  cm->channel = rdma_create_event_channel();
+  RDMA_CHECK_GOTO(cm->channel, "failed to create rdma_cm event channel",
+                  cm_init_exit);
+  if (config.server_name) {
+    memcpy(&cm->dst, resolved_addr->ai_addr, resolved_addr->ai_addrlen);
+  } else {
+    RDMA_CHECK_GOTO(0 == rdma_create_id(cm->channel, &cm->listen_id, NULL,
+                                        RDMA_PS_TCP),
+                    "failed to create rdma_cm id", cm_init_exit);
+    RDMA_CHECK_GOTO(0 == rdma_bind_addr(cm->listen_id,
+                                        resolved_addr->ai_addr),
+                    "failed to bind rdma_cm id", cm_init_exit);
+    RDMA_CHECK_GOTO(0 == rdma_listen(cm->listen_id, 16),
+                    "failed to listen on rdma_cm id", cm_init_exit);
+  }
+  rc = 0;
+
+cm_init_exit:
+  freeaddrinfo(resolved_addr);
+  return rc;
+}
+static void cm_destroy(struct cm_backend *cm) {
+  if (cm->cq)
+    ibv_destroy_cq(cm->cq);
+  if (cm->pd)
+    ibv_dealloc_pd(cm->pd);
+  if (cm->listen_id)
+    rdma_destroy_id(cm->listen_id);
+  if (cm->channel)
+    rdma_destroy_event_channel(cm->channel);
+}
+/* one connection from rdma_create_id, or the connect request, until
+ * ESTABLISHED, then disconnected and destroyed again */
+static int cm_connect_one(struct resources *res, struct cm_backend *cm,
+                          uint64_t *ns) {
+  struct rdma_conn_param param;
+  struct rdma_cm_id *id = NULL;
+  uint64_t t0;
+  int rc = 1;
+
+  cm_conn_param(&param);
+  if (config.server_name) {
+    t0 = get_time_ns();
+    RDMA_CHECK_GOTO(0 == rdma_create_id(cm->channel, &id, NULL, RDMA_PS_TCP),
+                    "failed to create rdma_cm id", cm_connect_one_exit);
+    RDMA_CHECK_GOTO(0 == rdma_resolve_addr(id, NULL,
+                                           (struct sockaddr *)&cm->dst,
+                                           CM_TIMEOUT_MS),
+                    "rdma_resolve_addr failed", cm_connect_one_exit);
+    RDMA_CHECK_GOTO(0 == cm_wait(cm, RDMA_CM_EVENT_ADDR_RESOLVED, NULL),
+                    "address resolution failed", cm_connect_one_exit);
+    RDMA_CHECK_GOTO(0 == rdma_resolve_route(id, CM_TIMEOUT_MS),
+                    "rdma_resolve_route failed", cm_connect_one_exit);
+    RDMA_CHECK_GOTO(0 == cm_wait(cm, RDMA_CM_EVENT_ROUTE_RESOLVED, NULL),
+                    "route resolution failed", cm_connect_one_exit);
+    RDMA_CHECK_GOTO(0 == cm_create_qp(res, cm, id), "failed to create QP",
+                    cm_connect_one_exit);
+    RDMA_CHECK_GOTO(0 == rdma_connect(id, &param), "rdma_connect failed",
+                    cm_connect_one_exit);
+  } else {
+    /* the server's clock starts with the connect request */
+    RDMA_CHECK_GOTO(0 == cm_wait(cm, RDMA_CM_EVENT_CONNECT_REQUEST, &id),
+                    "no connect request", cm_connect_one_exit);
+    t0 = get_time_ns();
+    RDMA_CHECK_GOTO(0 == cm_create_qp(res, cm, id), "failed to create QP",
+                    cm_connect_one_exit);
+    RDMA_CHECK_GOTO(0 == rdma_accept(id, &param), "rdma_accept failed",
+                    cm_connect_one_exit);
+  }
+  RDMA_CHECK_GOTO(0 == cm_wait(cm, RDMA_CM_EVENT_ESTABLISHED, NULL),
+                  "connection not established", cm_connect_one_exit);
+  *ns = get_time_ns() - t0;
+  /* the client hangs up, both sides see DISCONNECTED */
+  if (config.server_name)
+    rdma_disconnect(id);
+  RDMA_CHECK_GOTO(0 == cm_wait(cm, RDMA_CM_EVENT_DISCONNECTED, NULL),
+                  "disconnect failed", cm_connect_one_exit);
+  rc = 0;
+
+cm_connect_one_exit:
+  if (id)
+    cm_destroy_id(id);
+  return rc;
+}
+static int connect_cm_run(struct resources *res, uint64_t *samples,
+                          uint64_t *ns) {
+  struct cm_backend cm;
+  uint64_t start;
+  char temp_char;
+  size_t i;
+  int rc = 1;
+
+  memset(&cm, 0, sizeof cm);
+  RDMA_CHECK_GOTO(0 == cm_init(&cm), "failed to set up rdma_cm",
+                  connect_cm_run_exit);
+  /* the client resolves the server only once it listens */
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "L", &temp_char),
+                  "sync error before rdma_cm connections",
+                  connect_cm_run_exit);
+  start = get_time_ns();
+  for (i = 0; i < LOOP; ++i)
+    RDMA_CHECK_GOTO(0 == cm_connect_one(res, &cm, &samples[i]),
+                    "rdma_cm connection failed", connect_cm_run_exit);
+  *ns = get_time_ns() - start;
+  rc = 0;
+
+connect_cm_run_exit:
+  cm_destroy(&cm);
+  return rc;
+}
+#endif
+static int run_connect_test(struct resources *res) {
+  uint64_t *samples = NULL;
+  uint64_t ns;
+  char temp_char;
+  int rc = 1;
+
+  if (config.transport != IBV_QPT_RC) {
+    PRINT_ERR("the connect test connects RC QPs\n");
+    return 1;
+  }
+  samples = (uint64_t *)calloc(LOOP, sizeof(uint64_t));
+  RDMA_CHECK_GOTO(samples, "failed to allocate samples",
+                  run_connect_test_exit);
+  /* device, PD, CQ and MR stay, only the QP comes and goes */
+  RDMA_CHECK_GOTO(0 == resources_create(res), "failed to create resources",
+                  run_connect_test_exit);
+  RDMA_CHECK_GOTO(0 == resources_release(res, RES_LEVEL_MR),
+                  "failed to destroy the QP", run_connect_test_exit);
+  if (config.connect & CONN_TCP) {
+    RDMA_CHECK_GOTO(0 == connect_tcp_run(res, samples, &ns),
+                    "TCP connection failed", run_connect_test_exit);
+    report_connect("tcp", samples, ns);
   }
+#ifdef HAVE_RDMACM
+  if (config.connect & CONN_CM) {
+    RDMA_CHECK_GOTO(0 == connect_cm_run(res, samples, &ns),
+                    "rdma_cm connection failed", run_connect_test_exit);
+    report_connect("cm", samples, ns);
+  }
+#endif
+  RDMA_CHECK_GOTO(0 == sock_sync_data(res->sock, 1, "E", &temp_char),
+                  "sync error after connect test", run_connect_test_exit);
+  rc = 0;
+
+run_connect_test_exit:
+  free(samples);
   return rc;
 }
 
+/* benchmarks selectable with -t, indexed by enum test_type */
+static const struct {
+  const char *name;
+  int (*run)(struct resources *res);
+  int need_peer; /* whether a TCP connection to the other side is needed */
+} tests[TEST_NUM] = {
+    [TEST_SETUP] = {"setup", run_setup_test, 1},
+    [TEST_REGCACHE] = {"regcache", run_regcache_test, 0},
+    [TEST_QPPOOL] = {"qppool", run_qppool_test, 0},
+    [TEST_BW] = {"bw", run_bw_test, 1},
+    [TEST_LAT] = {"lat", run_lat_test, 1},
+    [TEST_BATCH] = {"batch", run_batch_test, 1},
+    [TEST_SIG] = {"sig", run_sig_test, 1},
+    [TEST_CQMODE] = {"cqmode", run_cqmode_test, 1},
+    [TEST_INLINE] = {"inline", run_inline_test, 1},
+    [TEST_SGE] = {"sge", run_sge_test, 1},
+    [TEST_SWEEP] = {"sweep", run_sweep_test, 1},
+    [TEST_ATOMIC] = {"atomic", run_atomic_test, 1},
+    [TEST_SRQ] = {"srq", run_srq_test, 1},
+    [TEST_QPSCALE] = {"qpscale", run_qpscale_test, 1},
+    [TEST_MTSETUP] = {"mtsetup", run_mtsetup_test, 1},
+    [TEST_TRANSPORT] = {"transport", run_transport_test, 1},
+    [TEST_CONNECT] = {"connect", run_connect_test, 1},
+    [TEST_EXCHANGE] = {"exchange", run_exchange_test, 1},
+};
+
+static int parse_test(const char *name) {
+  int test;
+  for (test = 0; test < TEST_NUM; ++test) {
+    if (!strcmp(name, tests[test].name))
+      return test;
+  }
+  return -1;
+}
+
 // Print out config information
 static void print_config(void) {
   PRINT(" ------------------------------------------------\n");
   PRINT(" Device name : \"%s\"\n", config.dev_name);
   PRINT(" IB port : %u\n", config.ib_port);
-  if (config.server_name)
+  if (config.server_name) {
     PRINT(" IP : %s\n", config.server_name);
+  }
   PRINT(" TCP port : %u\n", config.tcp_port);
-  if (config.gid_idx >= 0)
+  if (config.gid_idx >= 0) {
     PRINT(" GID index : %u\n", config.gid_idx);
+  }
+  PRINT(" Reuse level : %s\n", res_levels[config.reuse].name);
+  PRINT(" Test : %s\n", tests[config.test].name);
+  if (config.reg_cache) {
+    PRINT(" Registration cache : %zu bytes\n", config.reg_cache);
+  }
+  PRINT(" Buffer : %s, prefault %s\n", alloc_names[config.alloc],
+        prefault_names[config.prefault]);
+  if (config.test != TEST_SETUP) {
+    PRINT(" Opcode : %s, queue depth %d, poll batch %d\n",
+          opcode_names[config.opcode], config.qdepth, config.poll_batch);
+  }
+  if (config.mtu) {
+    PRINT(" MTU : %d\n", mtu_bytes(config.mtu));
+  }
+  if (config.inline_size < 0) {
+    PRINT(" Inline : largest granted\n");
+  } else if (config.inline_size) {
+    PRINT(" Inline : up to %d bytes\n", config.inline_size);
+  }
+  if (config.cq_mode == CQ_MODE_HYBRID) {
+    PRINT(" CQ mode : hybrid, spin %d usec\n", config.spin);
+  } else {
+    PRINT(" CQ mode : %s\n", cq_mode_names[config.cq_mode]);
+  }
+  if (config.transport == IBV_QPT_UD) {
+    PRINT(" Transport : UD\n");
+  }
+  if (config.threads > 1) {
+    PRINT(" Threads : %d\n", config.threads);
+  }
   PRINT(" ------------------------------------------------\n\n");
 }
 
+/* long only options of the sweep lists */
+enum {
+  OPT_SIZES = 0x100,
+  OPT_MTUS,
+  OPT_OPCODES,
+  OPT_RD_ATOMICS,
+  OPT_CPUS,
+  OPT_TRANSPORT,
+  OPT_CONNECT,
+  OPT_RECORD,
+  OPT_COUNTERS
+};
+static int parse_mtu_item(const char *item) {
+  int mtu = parse_mtu(item);
+  return mtu ? mtu : -1;
+}
+static int parse_opcode_item(const char *item) {
+  return parse_name(item, opcode_names,
+                    sizeof(opcode_names) / sizeof(char *));
+}
+static int parse_int_item(const char *item) {
+  int value = atoi(item);
+  return value > 0 ? value : -1;
+}
+static int parse_cpu_item(const char *item) {
+  char *end;
+  long cpu = strtol(item, &end, 10);
+  return end != item && !*end && cpu >= 0 ? cpu : -1;
+}
+/* comma separated list of at most SWEEP_MAX items, 1 if any is invalid */
+static int parse_list(const char *arg, int (*parse)(const char *item),
+                      int *values, int *num) {
+  char *list = strdup(arg);
+  char *save = NULL;
+  char *item;
+  int rc = 0;
+  *num = 0;
+  for (item = strtok_r(list, ",", &save); item && !rc;
+       item = strtok_r(NULL, ",", &save)) {
+    if (*num == SWEEP_MAX || (values[*num] = parse(item)) < 0)
+      rc = 1;
+    else
+      (*num)++;
+  }
+  free(list);
+  return rc || !*num;
+}
+/* sizes of the sweep test, a list or a geometric min:max[:factor] range */
+static int parse_sizes(const char *arg) {
+  size_t min = 0;
+  size_t max = 0;
+  size_t factor = 4;
+  size_t size;
+  char *end;
+  sweep.num_sizes = 0;
+  if (strchr(arg, ':')) {
+    if (sscanf(arg, "%zu:%zu:%zu", &min, &max, &factor) < 2 || !min ||
+        factor < 2)
+      return 1;
+    for (size = min; size <= max && sweep.num_sizes < SWEEP_MAX;
+         size *= factor)
+      sweep.sizes[sweep.num_sizes++] = size;
+    return 0;
+  }
+  while (*arg && sweep.num_sizes < SWEEP_MAX) {
+    size = strtoull(arg, &end, 0);
+    if (!size || (*end && *end != ','))
+      return 1;
+    sweep.sizes[sweep.num_sizes++] = size;
+    arg = *end ? end + 1 : end;
+  }
+  return *arg != '\0';
+}
+
 // print a description of command line syntax
 static void usage(const char *argv0) {
+  (void)argv0;
   PRINT("Usage:\n");
   PRINT(" %s start a server and wait for connection\n", argv0);
   PRINT(" %s <host> connect to server at <host>\n", argv0);
@@ -619,6 +4840,74 @@ static void usage(const char *argv0) {
         "(default not used)\n");
   PRINT(" -s, --size <size> use size <size> for transport data size\n");
   PRINT(" -l, --loop <loop number> use <loop number> for test loop number\n");
+  PRINT(" -r, --reuse <level> keep <level> and the levels above it alive across "
+        "iterations: none, device, pd, cq, mr or qp (default none)\n");
+  PRINT(" -t, --test <test> benchmark to run: setup, regcache, qppool, bw, "
+        "lat, batch, sig, cqmode, inline, sge, sweep, atomic or srq "
+        "(default setup)\n");
+  PRINT(" -c, --reg-cache <bytes> cache memory registrations, keeping at most "
+        "<bytes> pinned by idle entries (default disabled)\n");
+  PRINT(" -w, --reg-cache-ws <num> number of buffers used by the regcache test "
+        "(default 8)\n");
+  PRINT(" -q, --qp-pool <num> number of QPs created ahead by the qppool test "
+        "(default 16)\n");
+  PRINT(" -a, --alloc <allocator> data buffer allocator: malloc, mmap, huge2m, "
+        "huge1g or thp (default malloc)\n");
+  PRINT(" -f, --prefault <policy> fault the buffer in before registration: "
+        "none, memset or populate (default memset)\n");
+  PRINT(" -o, --opcode <opcode> data path operation: send, write or read, "
+        "fadd or cas for the atomic test (default send)\n");
+  PRINT(" -D, --qdepth <num> queue depth and number of outstanding WRs "
+        "(default 1)\n");
+  PRINT(" -b, --batch <num> largest chain of WRs posted with one "
+        "ibv_post_send by the batch test (default 64)\n");
+  PRINT(" -S, --signal <num> request a completion for every <num>th WR only "
+        "(default 1)\n");
+  PRINT(" -B, --poll-batch <num> drain up to <num> completions per "
+        "ibv_poll_cq (default 16)\n");
+  PRINT(" -C, --cq-mode <mode> wait for completions by busy polling, event "
+        "(sleep on a completion channel) or hybrid (default busy)\n");
+  PRINT(" -H, --spin <usec> time hybrid mode spins before sleeping "
+        "(default 20)\n");
+  PRINT(" -I, --inline <bytes> send messages up to <bytes> inline, max for "
+        "the largest size the device grants (default 0, disabled)\n");
+  PRINT(" -F, --frags <num> largest number of fragments gathered by the sge "
+        "test (default 16, capped by the device max_sge)\n");
+  PRINT(" -M, --mtu <bytes> path MTU: 256, 512, 1024, 2048 or 4096, at most "
+        "the active MTU of the port (default active MTU)\n");
+  PRINT(" -A, --rd-atomic <num> outstanding RDMA READ/atomic per QP "
+        "(default 1, the bw tests use the queue depth for read)\n");
+  PRINT(" -T, --timeout <num> local ACK timeout, 4.096 usec * 2^<num> "
+        "(default 18)\n");
+  PRINT(" -Y, --retry <num> retransmissions before a WR fails (default 6)\n");
+  PRINT(" --sizes <list> sizes of the sweep test, <a>,<b>,.. or "
+        "<min>:<max>[:<factor>] (default 1:<size>:4)\n");
+  PRINT(" --mtus <list> MTUs of the sweep test, e.g. 1024,4096 (default -M)\n");
+  PRINT(" --opcodes <list> opcodes of the sweep test, e.g. send,write "
+        "(default -o)\n");
+  PRINT(" --rd-atomics <list> rd_atomic values of the sweep test "
+        "(default -A)\n");
+  PRINT(" -O, --output <file> CSV file with one row per sweep point\n");
+  PRINT(" -n, --clients <num> clients the atomic test server waits for "
+        "(default 1)\n");
+  PRINT(" -z, --slots <num> remote slots the atomic test spreads over, 1 is a "
+        "single hot slot (default 1)\n");
+  PRINT(" -Q, --srq <num> srq test: server QPs share one SRQ of <num> >= 4 "
+        "receives (default 0, a receive queue per QP)\n");
+  PRINT(" --transport <rc|ud> QP type of the lat and bw tests, ud with "
+        "send only (default rc)\n");
+  PRINT(" --connect <tcp|cm|both> connection backends of the connect "
+        "test (default both when built with librdmacm)\n");
+  PRINT(" -N, --qps <num> RC QPs connected by the qpscale and exchange tests "
+        "(default 1024)\n");
+  PRINT(" -j, --threads <num> bw and mtsetup tests on 1, 2, 4 .. <num> "
+        "threads, each with its own CQ, MR and QP (default 1)\n");
+  PRINT(" --cpus <list> cores the threads are pinned to, e.g. 0,2,4,6 "
+        "(default thread i on core i)\n");
+  PRINT(" --record <file> append every timed verb to a binary record file, "
+        "see statistics.py --record\n");
+  PRINT(" --counters print port (sysfs counters, hw_counters) and CPU "
+        "(perf_event) counter deltas of the run and of the setup phases\n");
 }
 
 /******************************************************************************
@@ -640,7 +4929,6 @@ static void usage(const char *argv0) {
 int main(int argc, char *argv[]) {
   struct resources res;
   int rc = 1;
-  char temp_char;
   /* parse the command line parameters */
   while (1) {
     int c;
@@ -651,8 +4939,43 @@ int main(int argc, char *argv[]) {
         {.name = "gid-idx", .has_arg = 1, .val = 'g'},
         {.name = "size", .has_arg = 1, .val = 's'},
         {.name = "loop", .has_arg = 1, .val = 'l'},
+        {.name = "reuse", .has_arg = 1, .val = 'r'},
+        {.name = "test", .has_arg = 1, .val = 't'},
+        {.name = "reg-cache", .has_arg = 1, .val = 'c'},
+        {.name = "reg-cache-ws", .has_arg = 1, .val = 'w'},
+        {.name = "qp-pool", .has_arg = 1, .val = 'q'},
+        {.name = "alloc", .has_arg = 1, .val = 'a'},
+        {.name = "prefault", .has_arg = 1, .val = 'f'},
+        {.name = "opcode", .has_arg = 1, .val = 'o'},
+        {.name = "qdepth", .has_arg = 1, .val = 'D'},
+        {.name = "batch", .has_arg = 1, .val = 'b'},
+        {.name = "signal", .has_arg = 1, .val = 'S'},
+        {.name = "poll-batch", .has_arg = 1, .val = 'B'},
+        {.name = "cq-mode", .has_arg = 1, .val = 'C'},
+        {.name = "spin", .has_arg = 1, .val = 'H'},
+        {.name = "inline", .has_arg = 1, .val = 'I'},
+        {.name = "frags", .has_arg = 1, .val = 'F'},
+        {.name = "mtu", .has_arg = 1, .val = 'M'},
+        {.name = "rd-atomic", .has_arg = 1, .val = 'A'},
+        {.name = "timeout", .has_arg = 1, .val = 'T'},
+        {.name = "retry", .has_arg = 1, .val = 'Y'},
+        {.name = "sizes", .has_arg = 1, .val = OPT_SIZES},
+        {.name = "mtus", .has_arg = 1, .val = OPT_MTUS},
+        {.name = "opcodes", .has_arg = 1, .val = OPT_OPCODES},
+        {.name = "rd-atomics", .has_arg = 1, .val = OPT_RD_ATOMICS},
+        {.name = "output", .has_arg = 1, .val = 'O'},
+        {.name = "clients", .has_arg = 1, .val = 'n'},
+        {.name = "slots", .has_arg = 1, .val = 'z'},
+        {.name = "srq", .has_arg = 1, .val = 'Q'},
+        {.name = "qps", .has_arg = 1, .val = 'N'},
+        {.name = "threads", .has_arg = 1, .val = 'j'},
+        {.name = "cpus", .has_arg = 1, .val = OPT_CPUS},
+        {.name = "transport", .has_arg = 1, .val = OPT_TRANSPORT},
+        {.name = "connect", .has_arg = 1, .val = OPT_CONNECT},
+        {.name = "record", .has_arg = 1, .val = OPT_RECORD},
+        {.name = "counters", .has_arg = 0, .val = OPT_COUNTERS},
         {.name = NULL, .has_arg = 0, .val = '\0'}};
-    c = getopt_long(argc, argv, "p:d:i:g:s:l:", long_options, NULL);
+    c = getopt_long(argc, argv, "p:d:i:g:s:l:r:t:c:w:q:a:f:o:D:b:S:B:C:H:I:F:M:A:T:Y:O:n:z:Q:j:N:", long_options, NULL);
     if (c == -1)
       break;
     switch (c) {
@@ -682,12 +5005,242 @@ int main(int argc, char *argv[]) {
     case 'l':
       LOOP = strtouq(optarg, NULL, 0);
       break;
+    case 'r':
+      config.reuse = parse_res_level(optarg);
+      if (config.reuse < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 't':
+      config.test = parse_test(optarg);
+      if (config.test < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'c':
+      config.reg_cache = strtouq(optarg, NULL, 0);
+      break;
+    case 'w':
+      config.reg_cache_ws = strtoul(optarg, NULL, 0);
+      if (config.reg_cache_ws <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'q':
+      config.qp_pool = strtoul(optarg, NULL, 0);
+      if (config.qp_pool <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'a':
+      config.alloc = parse_name(optarg, alloc_names, ALLOC_NUM);
+      if (config.alloc < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'f':
+      config.prefault = parse_name(optarg, prefault_names, PREFAULT_NUM);
+      if (config.prefault < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'o':
+      config.opcode = parse_name(optarg, opcode_names,
+                                 sizeof(opcode_names) / sizeof(char *));
+      if (config.opcode < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'D':
+      config.qdepth = strtoul(optarg, NULL, 0);
+      if (config.qdepth <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'b':
+      config.batch = strtoul(optarg, NULL, 0);
+      if (config.batch <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'S':
+      config.signal = strtoul(optarg, NULL, 0);
+      if (config.signal <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'B':
+      config.poll_batch = strtoul(optarg, NULL, 0);
+      if (config.poll_batch <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'C':
+      config.cq_mode = parse_name(optarg, cq_mode_names, CQ_MODE_NUM);
+      if (config.cq_mode < 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'H':
+      config.spin = strtoul(optarg, NULL, 0);
+      break;
+    case 'M':
+      config.mtu = parse_mtu(optarg);
+      if (!config.mtu) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'A':
+      config.rd_atomic = strtoul(optarg, NULL, 0);
+      if (config.rd_atomic <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'T':
+      config.timeout = strtoul(optarg, NULL, 0);
+      break;
+    case 'Y':
+      config.retry_cnt = strtoul(optarg, NULL, 0);
+      break;
+    case 'O':
+      config.output = strdup(optarg);
+      break;
+    case 'n':
+      config.clients = strtoul(optarg, NULL, 0);
+      if (config.clients <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'Q':
+      config.srq = strtoul(optarg, NULL, 0);
+      break;
+    case 'N':
+      config.qps = strtoul(optarg, NULL, 0);
+      if (config.qps <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'j':
+      config.threads = strtoul(optarg, NULL, 0);
+      if (config.threads <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case OPT_TRANSPORT:
+      if (!strcmp(optarg, "rc")) {
+        config.transport = IBV_QPT_RC;
+      } else if (!strcmp(optarg, "ud")) {
+        config.transport = IBV_QPT_UD;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case OPT_CONNECT:
+      if (!strcmp(optarg, "tcp")) {
+        config.connect = CONN_TCP;
+      } else if (!strcmp(optarg, "cm")) {
+        config.connect = CONN_CM;
+      } else if (!strcmp(optarg, "both")) {
+        config.connect = CONN_TCP | CONN_CM;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+#ifndef HAVE_RDMACM
+      if (config.connect & CONN_CM) {
+        PRINT_ERR("built without librdmacm, see the Makefile\n");
+        return 1;
+      }
+#endif
+      break;
+    case OPT_RECORD:
+      config.record = strdup(optarg);
+      break;
+    case OPT_COUNTERS:
+      config.counters = 1;
+      break;
+    case OPT_CPUS:
+      if (parse_list(optarg, parse_cpu_item, config.cpus, &config.num_cpus)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'z':
+      config.slots = strtoul(optarg, NULL, 0);
+      if (config.slots <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case OPT_SIZES:
+      if (parse_sizes(optarg)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case OPT_MTUS:
+      if (parse_list(optarg, parse_mtu_item, sweep.mtus, &sweep.num_mtus)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case OPT_OPCODES:
+      if (parse_list(optarg, parse_opcode_item, sweep.opcodes,
+                     &sweep.num_opcodes)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case OPT_RD_ATOMICS:
+      if (parse_list(optarg, parse_int_item, sweep.rd_atomics,
+                     &sweep.num_rd_atomics)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'F':
+      config.frags = strtoul(optarg, NULL, 0);
+      if (config.frags <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'I':
+      if (!strcmp(optarg, "max"))
+        config.inline_size = -1;
+      else
+        config.inline_size = strtoul(optarg, NULL, 0);
+      break;
 
     default:
       usage(argv[0]);
       return 1;
     }
   }
+  /* MAP_POPULATE needs a mapping of our own */
+  if (config.alloc == ALLOC_MALLOC && config.prefault == PREFAULT_POPULATE) {
+    PRINT_ERR("prefault populate needs an mmap based allocator\n");
+    usage(argv[0]);
+    return 1;
+  }
   /* parse the last parameter (if exists) as the server name */
   if (optind == argc - 1)
     config.server_name = argv[optind];
@@ -697,59 +5250,68 @@ int main(int argc, char *argv[]) {
     usage(argv[0]);
     return 1;
   }
+  /* a limit of srq / SRQ_LIMIT_DIV = 0 would disarm the refill event, and
+   * only the srq test knows how to feed a shared receive queue */
+  if (config.srq && (config.srq < SRQ_LIMIT_DIV || config.test != TEST_SRQ)) {
+    PRINT_ERR("-Q needs -t srq and at least %d entries\n", SRQ_LIMIT_DIV);
+    return 1;
+  }
+  /* the sig test picks its own intervals */
+  if (config.test != TEST_SIG && config.signal > config.qdepth) {
+    PRINT_ERR("signal interval %d exceeds the queue depth %d\n", config.signal,
+              config.qdepth);
+    return 1;
+  }
+  if (config.transport == IBV_QPT_UD &&
+      ((config.test != TEST_LAT && config.test != TEST_BW) ||
+       config.opcode != IBV_WR_SEND || config.threads > 1)) {
+    PRINT_ERR("UD runs the single-threaded lat and bw tests with send only\n");
+    return 1;
+  }
   /* print the used parameters for info*/
   print_config();
+  /* calibrate the clock of the poll timeouts and every measurement up front,
+   * not inside a timed operation */
+  timer_init();
+#ifdef LOG_TO_FILE
+  atexit(hist_dump);
+#endif
   /* init all of the resources, so cleanup will be easy */
   resources_init(&res);
+  if (config.record)
+    RDMA_CHECK_GOTO(0 == record_open(config.record),
+                    "failed to open record file", main_exit);
   /* create resources before using them */
 
-  RDMA_CHECK_GOTO(0 == sock_create(&res), "failed to create sock", main_exit);
-
-  double sum_time;   // sum of all time
-  double sum10_time; // sum of 10 iterations time
-  for (int i = 0; i < LOOP; ++i) {
-    size_t _t = get_timestamp();
-    RDMA_CHECK_GOTO(0 == resources_create(&res), "failed to create resources",
-                    main_exit);
-    /* connect the QPs */
-    RDMA_CHECK_GOTO(0 == connect_qp(&res), "failed to connect QPs", main_exit);
-    /* let the server post the sr */
-    if (!config.server_name) {
-      RDMA_CHECK_GOTO(0 == post_send(&res, IBV_WR_SEND), "failed to post sr",
-                      main_exit);
-    }
-    /* in both sides we expect to get a completion */
-    RDMA_CHECK_GOTO(0 == poll_completion(&res), "poll completion failed",
+  if (tests[config.test].need_peer)
+    RDMA_CHECK_GOTO(0 == sock_create(&res), "failed to create sock",
                     main_exit);
 
-    /* Sync so we are sure server side has data ready before client tries to
-     * read it; just send a dummy char back and forth */
-    RDMA_CHECK_GOTO(0 == sock_sync_data(res.sock, 1, "R", &temp_char),
-                    "sync error before RDMA ops", main_exit);
-
-    RDMA_CHECK(0 == resources_destroy(&res), "failed to destroy resources");
-    rc = 0;
-
-    _t = get_timestamp() - _t;
-    sum_time += _t;
-    sum10_time += _t;
-    if (i % 10 == 9) {
-      fprintf(stderr,
-              "[Packet-%ld][%d/%ld] TEN_ITER_AVG(ms): %.2lf, AVG_TIME(ms): %.2lf\n",
-              MSG_SIZE, i + 1, LOOP, sum10_time / 10.0 / 1000.0, sum_time / (i + 1) / 1000.0);
-      sum10_time = 0;
-    }
-  } // end for
+  if (config.counters) {
+    struct counter_snap begin;
+    struct counter_snap end;
+    struct counter_snap delta;
+    memset(&delta, 0, sizeof delta);
+    RDMA_CHECK_GOTO(0 == counters_init(), "no counters available", main_exit);
+    counters_snap(&begin);
+    rc = tests[config.test].run(&res);
+    counters_snap(&end);
+    counters_add(&delta, &begin, &end);
+    report_counters(tests[config.test].name, "run", &delta, 1);
+  } else {
+    rc = tests[config.test].run(&res);
+  }
 
 main_exit:
-  if (rc != 0) {
-    RDMA_CHECK(0 == resources_destroy(&res), "failed to destroy resources");
-  }
+  counters_close();
+  RDMA_CHECK(0 == resources_destroy(&res), "failed to destroy resources");
 
   RDMA_CHECK(0 == sock_destroy(&res), "failed to destroy socket resources");
 
   if (config.dev_name)
     free((char *)config.dev_name);
+  if (config.record)
+    free((char *)config.record);
   if (rc == 0) {
     PRINT_OK("\ntest result is OK\n");
   } else {
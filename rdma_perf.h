@@ -1,7 +1,13 @@
+/* CPU affinity of the worker threads */
+#define _GNU_SOURCE
 #include <byteswap.h>
 #include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,17 +15,102 @@
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#include <dirent.h>
 #include <infiniband/verbs.h>
+#include <linux/perf_event.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#ifdef HAVE_RDMACM
+#include <rdma/rdma_cma.h>
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
+/* length of the TSC calibration against CLOCK_MONOTONIC_RAW in millisec */
+#define TIMER_CALIBRATE_MS 20
+/* back-to-back timer reads whose minimum is the timer's own overhead */
+#define TIMER_OVERHEAD_ROUNDS 1000
+/* log-linear LOG_TIME histograms (LOG_TO_FILE builds): 2^HIST_SUB_BITS
+ * buckets per power of two, values from 0 to 2^HIST_RANGE_BITS ns */
+#define HIST_SUB_BITS 5
+#define HIST_RANGE_BITS 40
+#define HIST_BUCKETS ((HIST_RANGE_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+/* distinct (verb, size) pairs one process keeps histograms of */
+#define HIST_MAX 128
+/* LOG_TIME samples a thread buffers before one write(2) to the record file */
+#define RECORD_BUF 4096
+/* distinct verbs a record file names */
+#define RECORD_VERBS_MAX 64
+#define RECORD_MAGIC "RDMAPREC"
+#define RECORD_VERSION 1
+/* files of /sys/class/infiniband/<dev>/ports/<port>/{counters,hw_counters}
+ * snapshotted by --counters */
+#define PORT_COUNTERS_MAX 128
 /* poll CQ timeout in millisec (2 seconds) */
 #define MAX_POLL_CQ_TIMEOUT 2000
+/* empty polls between two looks at the clock */
+#define POLL_CQ_TIMEOUT_CHECK 1024
+/* upper bound of the max_inline_data probe */
+#define INLINE_PROBE_MAX 4096
+/* largest message of the inline test */
+#define INLINE_TEST_MAX 1024
+/* distance between the remote slots of the atomic test, one cache line so
+ * that striped slots do not share one */
+#define ATOMIC_SLOT_STRIDE 64
+/* chains of the largest batch the batch test keeps in flight, so that the
+ * next doorbell is rung while the previous chain is still executing */
+#define BATCH_WINDOW_CHAINS 2
+/* receives posted per ibv_post_srq_recv when the SRQ is refilled */
+#define SRQ_POST_BATCH 32
+/* the SRQ limit event fires when fewer than srq / SRQ_LIMIT_DIV receives
+ * are left */
+#define SRQ_LIMIT_DIV 4
+/* Q_Key of the UD QPs, the same on both sides */
+#define UD_QKEY 0x11111111
+/* every UD receive starts with the 40-byte GRH, present or not */
+#define UD_GRH_SIZE 40
+/* the rdma_cm backend of the connect test listens on the TCP port plus this */
+#define CM_PORT_OFFSET 1
+/* address and route resolution timeout of rdma_cm in millisec */
+#define CM_TIMEOUT_MS 2000
+/* distinct verbs a verb_sink keeps samples of */
+#define VERB_SINK_MAX 32
+/* longest list of values per sweep dimension */
+#define SWEEP_MAX 32
+/* fragments gathered by the sge test unless -F says otherwise */
+#define SGE_TEST_FRAGS 16
+/* fragment sizes of the sge test, SGE_TEST_MIN_FRAG times powers of
+ * SGE_TEST_FRAG_STEP up to MSG_SIZE */
+#define SGE_TEST_MIN_FRAG 64
+#define SGE_TEST_FRAG_STEP 8
 #define MSG "Hello HURRAY!"
 #define RDMAMSGR "RDMA read operation "
 #define RDMAMSGW "RDMA write operation"
+/* wr_id carries the kind of WR in its top byte, completions are dispatched
+ * on it by cq_poller_poll */
+#define WRID_KIND_SHIFT 56
+#define MAKE_WRID(kind, id) (((uint64_t)(kind) << WRID_KIND_SHIFT) | (id))
+#define WRID_KIND(wr_id) ((int)((wr_id) >> WRID_KIND_SHIFT))
+#define WRID_ID(wr_id) ((wr_id) & ((1ULL << WRID_KIND_SHIFT) - 1))
+enum wrid_kind {
+  WRID_SEND = 0, /* send queue WR: SEND, RDMA WRITE/READ */
+  WRID_RECV,     /* receive queue WR */
+  WRID_KIND_NUM
+};
 
 //#define LOG_TO_FILE
 
@@ -55,11 +146,8 @@
     } while(0)
 #define PRINT(msg...) fprintf(stdout, msg);
 #else
-#define PRINT_TIME(name, time)                        \
-    do {                                              \
-            fprintf(stdout, "%s %zu", name, time);   \
-            fprintf(stdout, "\n");                    \
-    } while(0)
+/* recorded into the histogram of name at MSG_SIZE, dumped at exit */
+#define PRINT_TIME(name, time) hist_record(name, MSG_SIZE, time)
 #define PRINT_SUCC(msg...)
 #define PRINT(msg...) 
 #endif
@@ -80,18 +168,239 @@
         }                                             \
     } while(0)
 
-size_t get_timestamp() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec * 1000000 + tv.tv_usec;
+/* the one calibrated clock of the tool, see timer_init: get_cycles() for
+ * cycle counts and poll timeouts, get_time_ns() and LOG_TIME for ns */
+static struct {
+  int tsc;              /* the cycle counter runs at a constant rate */
+  double ns_per_cycle;  /* get_cycles() period, against CLOCK_MONOTONIC_RAW */
+  uint64_t overhead_ns; /* cost of one timer_start/timer_stop pair */
+} timer;
+
+static inline uint64_t timer_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* raw CPU cycle counter (TSC on x86, virtual counter on aarch64) */
+static inline uint64_t get_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  return timer_clock_ns();
+#endif
+}
+
+/* monotonic timestamp in nanoseconds, for operations far below 1us */
+static inline uint64_t get_time_ns() {
+  if (timer.tsc)
+    return (uint64_t)(get_cycles() * timer.ns_per_cycle);
+  return timer_clock_ns();
+}
+
+/* the lfence pair keeps earlier instructions from finishing after the read
+ * and the timed code from starting before it, isb does the same on aarch64 */
+static inline uint64_t timer_start(void) {
+  if (timer.tsc) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t t;
+    _mm_lfence();
+    t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    uint64_t t;
+#if defined(__aarch64__)
+    asm volatile("isb" ::: "memory");
+#endif
+    t = get_cycles();
+#if defined(__aarch64__)
+    asm volatile("isb" ::: "memory");
+#endif
+    return t;
+#endif
+  }
+  return timer_clock_ns();
+}
+/* rdtscp waits for the timed code to retire, the lfence keeps later
+ * instructions out of the measurement */
+static inline uint64_t timer_stop(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (timer.tsc) {
+    unsigned int aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+  }
+#endif
+  return timer_start();
+}
+/* ns from a timer_start value to now, less the timer's own overhead */
+static inline uint64_t timer_elapsed_ns(uint64_t start) {
+  uint64_t ticks = timer_stop() - start;
+  uint64_t ns = timer.tsc ? (uint64_t)(ticks * timer.ns_per_cycle) : ticks;
+  return ns > timer.overhead_ns ? ns - timer.overhead_ns : 0;
+}
+static inline int timer_invariant_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  /* CPUID.80000007H:EDX[8], the TSC runs at a constant rate in all states */
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+    return (edx >> 8) & 1;
+  return 0;
+#elif defined(__aarch64__)
+  /* the generic timer has a fixed frequency by architecture */
+  return 1;
+#else
+  return 0;
+#endif
 }
+/* calibrates get_cycles() against CLOCK_MONOTONIC_RAW, uses it for every ns
+ * measurement when it runs at a constant rate and clock_gettime otherwise,
+ * and measures what a timer_start/timer_stop pair costs */
+static void timer_init(void) {
+  uint64_t overhead = UINT64_MAX;
+  uint64_t t0 = timer_clock_ns();
+  uint64_t c0 = get_cycles();
+  uint64_t t1;
+  int i;
+  timer.tsc = 0;
+  timer.overhead_ns = 0;
+  while ((t1 = timer_clock_ns()) - t0 < TIMER_CALIBRATE_MS * 1000000ULL)
+    ;
+  timer.ns_per_cycle = (double)(t1 - t0) / (get_cycles() - c0);
+  timer.tsc = timer_invariant_tsc();
+  for (i = 0; i < TIMER_OVERHEAD_ROUNDS; ++i) {
+    uint64_t ns = timer_elapsed_ns(timer_start());
+    if (ns < overhead)
+      overhead = ns;
+  }
+  timer.overhead_ns = overhead;
+}
+
+/* perf_event CPU counters of --counters, counted for the process' threads */
+enum cpu_counter {
+  CPU_CYCLES,
+  CPU_INSTRUCTIONS,
+  CPU_PAGE_FAULTS,
+  CPU_DTLB_MISSES,
+  CPU_COUNTER_NUM
+};
+/* values of all counters at one point, or the delta over phases */
+struct counter_snap {
+  uint64_t cpu[CPU_COUNTER_NUM];
+  uint64_t port[PORT_COUNTERS_MAX];
+};
+
+/* log-linear histogram of the LOG_TIME samples of one verb at one message
+ * size, in ns; exact count, sum, min and max, values within 1/2^HIST_SUB_BITS
+ * by bucket. Updated with relaxed atomics so threads share one */
+struct hist {
+  const char *name;
+  size_t size;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+};
+#ifdef LOG_TO_FILE
+static void hist_record(const char *name, size_t size, uint64_t ns);
+#endif
+
+/* one LOG_TIME sample in a record file, host byte order */
+struct record {
+  uint64_t size;     /* MSG_SIZE */
+  uint64_t ns;       /* duration of the verb */
+  uint32_t iter;     /* sample of the verb at size in this thread */
+  uint32_t qp;       /* qp_num of the QP the thread created last */
+  uint16_t verb;     /* index into the name table at the end of the file */
+  uint16_t thread;   /* order in which threads recorded their first sample */
+  uint32_t reserved;
+};
+/* name, offset and width of one struct record field in the file header */
+struct record_field {
+  char name[12];
+  uint16_t offset;
+  uint16_t size;
+};
+/* start of a record file, followed by the records from hdr_size on and,
+ * once the file is closed, the verb name table at names_offset: a uint32_t
+ * count and that many NUL terminated names */
+struct record_hdr {
+  char magic[8];
+  uint32_t version;
+  uint32_t hdr_size;
+  uint32_t rec_size;
+  uint32_t num_fields;
+  uint64_t names_offset; /* 0 while the run is still writing */
+  struct record_field fields[6];
+};
+/* samples of one thread not yet written to the record file */
+struct record_buf {
+  struct record recs[RECORD_BUF];
+  int num;
+  uint16_t thread;
+  uint64_t size;                    /* MSG_SIZE iters count at */
+  uint32_t iters[RECORD_VERBS_MAX];
+};
+/* record file opened by record_open, -1 = none */
+static int record_fd = -1;
+/* qp_num stored in this thread's records, see create_qp */
+static __thread uint32_t record_qp;
+static void record_sample(const char *name, uint64_t ns);
+
+/* LOG_TIME samples of one verb collected by a verb_sink, in ns */
+struct verb_stat {
+  const char *name;
+  uint64_t *samples;
+  size_t num;
+  size_t cap;
+};
+/* per-thread collector of LOG_TIME samples, see verb_sink_add */
+struct verb_sink {
+  struct verb_stat verbs[VERB_SINK_MAX];
+  int num;
+};
+/* while set, LOG_TIME in this thread records into the sink instead of
+ * printing */
+static __thread struct verb_sink *verb_sink;
+static void verb_sink_add(struct verb_sink *sink, const char *name,
+                          uint64_t ns);
+
+/* hands one sample of name to the record file, verb_sink or PRINT_TIME */
+#define LOG_SAMPLE(name, ns)                          \
+    do {                                              \
+        if (record_fd >= 0)                           \
+            record_sample(name, ns);                  \
+        if (verb_sink)                                \
+            verb_sink_add(verb_sink, name, ns);       \
+        else                                          \
+            PRINT_TIME(name, ns);                     \
+    } while(0)
 
+/* times expr in ns, see timer_start */
 #define LOG_TIME(expr, name)                          \
     do {                                              \
-        size_t t0 = get_timestamp();                  \
+        uint64_t t0 = timer_start();                  \
         (expr);                                       \
-        size_t t1 = get_timestamp();                  \
-        PRINT_TIME(name, t1 - t0);         \
+        size_t ns = timer_elapsed_ns(t0);             \
+        LOG_SAMPLE(name, ns);                         \
+    } while(0)
+
+/* LOG_TIME that also adds the time of expr alone, without the logging, to
+ * total, atomically since the mtsetup threads share the totals */
+#define LOG_TIME_ADD(expr, name, total)                     \
+    do {                                                    \
+        uint64_t t0 = timer_start();                        \
+        (expr);                                             \
+        size_t ns = timer_elapsed_ns(t0);                   \
+        __atomic_fetch_add(&(total), ns, __ATOMIC_RELAXED); \
+        LOG_SAMPLE(name, ns);                               \
     } while(0)
 
 #define LOG_TIME_CHECK(expr, name, checkop)           \
@@ -117,6 +426,92 @@ static inline uint64_t ntohll(uint64_t x) { return x; }
 #else
 #error __BYTE_ORDER is neither __LITTLE_ENDIAN nor __BIG_ENDIAN
 #endif
+/* resource levels, ordered from the longest-lived object to the shortest one.
+ * Reusing a level keeps that level and every level above it alive across
+ * iterations of the main loop */
+enum res_level {
+  RES_LEVEL_NONE = 0, /* full teardown every iteration */
+  RES_LEVEL_DEVICE,   /* device context (ibv_open_device) */
+  RES_LEVEL_PD,       /* protection domain */
+  RES_LEVEL_CQ,       /* completion queue */
+  RES_LEVEL_MR,       /* data buffer and its memory region */
+  RES_LEVEL_QP,       /* queue pair, recycled through RESET */
+  RES_LEVEL_NUM
+};
+
+/* benchmarks selected with -t, setup is the original per-iteration
+ * create/connect/send/destroy loop */
+enum test_type {
+  TEST_SETUP = 0, /* control path setup and teardown cost */
+  TEST_REGCACHE,  /* registration cache hit/miss cost, local only */
+  TEST_QPPOOL,    /* QP pool acquire versus create, local only */
+  TEST_BW,        /* steady state bandwidth with a window of WRs */
+  TEST_LAT,       /* ping-pong round trip latency */
+  TEST_BATCH,     /* doorbell batching, chains of 1..batch WRs per post */
+  TEST_SIG,       /* selective signaling, a CQE every 1..qdepth WRs */
+  TEST_CQMODE,    /* latency and CPU time of busy, event and hybrid polling */
+  TEST_INLINE,    /* small messages with and without IBV_SEND_INLINE */
+  TEST_SGE,       /* multi-SGE gather versus memcpy into a bounce buffer */
+  TEST_SWEEP,     /* size x MTU x opcode x rd_atomic on one connection */
+  TEST_ATOMIC,    /* fetch-and-add / compare-and-swap rate and contention */
+  TEST_SRQ,       /* receive latency and memory, shared versus per-QP RQs */
+  TEST_QPSCALE,   /* setup rate, memory and message rate over many RC QPs */
+  TEST_MTSETUP,   /* resources_create + connect_qp from many threads at once */
+  TEST_TRANSPORT, /* lat and bw over RC, then over UD, side by side */
+  TEST_CONNECT,   /* connection setup over the TCP exchange versus rdma_cm */
+  TEST_EXCHANGE,  /* per-QP round trips versus one batched exchange */
+  TEST_NUM
+};
+
+/* connection backends of the connect test, a bit each */
+enum conn_backend {
+  CONN_TCP = 1 << 0, /* cm_con_data_t over the TCP socket, manual QP states */
+  CONN_CM = 1 << 1,  /* librdmacm address/route resolution and connect */
+};
+#ifdef HAVE_RDMACM
+#define CONN_DEFAULT (CONN_TCP | CONN_CM)
+#else
+#define CONN_DEFAULT CONN_TCP
+#endif
+
+/* data buffer allocators selected with -a */
+enum buf_alloc {
+  ALLOC_MALLOC = 0, /* plain malloc, 4KB pages */
+  ALLOC_MMAP,       /* anonymous mmap, 4KB pages */
+  ALLOC_HUGE_2M,    /* MAP_HUGETLB with 2MB pages */
+  ALLOC_HUGE_1G,    /* MAP_HUGETLB with 1GB pages */
+  ALLOC_THP,        /* 2MB aligned mmap with madvise(MADV_HUGEPAGE) */
+  ALLOC_NUM
+};
+
+/* how the data buffer is faulted in before registration, selected with -f */
+enum buf_prefault {
+  PREFAULT_NONE = 0, /* leave it to ibv_reg_mr */
+  PREFAULT_MEMSET,   /* touch every byte with memset */
+  PREFAULT_POPULATE, /* MAP_POPULATE (MADV_POPULATE_WRITE for thp) */
+  PREFAULT_NUM
+};
+
+/* how cq_poller_poll waits for completions, selected with -C */
+enum cq_mode {
+  CQ_MODE_BUSY = 0, /* spin on ibv_poll_cq */
+  CQ_MODE_EVENT,    /* arm the CQ and sleep in epoll on its channel */
+  CQ_MODE_HYBRID,   /* spin for config.spin usec, then arm and sleep */
+  CQ_MODE_NUM
+};
+
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
 /* structure of test parameters */
 struct config_t {
   const char *dev_name; /* IB device name */
@@ -124,6 +519,126 @@ struct config_t {
   u_int32_t tcp_port;   /* server TCP port */
   int ib_port;          /* local IB port to work with */
   int gid_idx;          /* gid index to use */
+  int reuse;            /* enum res_level kept alive across iterations */
+  int test;             /* enum test_type to run */
+  size_t reg_cache;     /* registration cache budget in bytes, 0 = disabled */
+  int reg_cache_ws;     /* number of buffers touched by the regcache test */
+  int qp_pool;          /* number of QPs created ahead by the QP pool */
+  int alloc;            /* enum buf_alloc for data buffers */
+  int prefault;         /* enum buf_prefault for data buffers */
+  int opcode;           /* IBV_WR_* used by the data path tests */
+  int qdepth;           /* send/recv queue depth and outstanding WR window */
+  int rd_atomic;        /* outstanding RDMA READ/atomic per QP */
+  int batch;            /* largest WR chain posted by the batch test */
+  int signal;           /* request a completion for every signal-th WR */
+  int poll_batch;       /* max completions drained per ibv_poll_cq */
+  int cq_mode;          /* enum cq_mode */
+  int spin;             /* usec spent spinning before sleeping in hybrid mode */
+  int inline_size;      /* max_inline_data asked for, -1 = largest possible */
+  int frags;            /* max_send_sge asked for, fragments of the sge test */
+  int mtu;              /* enum ibv_mtu of the path, 0 = port active_mtu */
+  int timeout;          /* local ACK timeout, 4.096 usec * 2^timeout */
+  int retry_cnt;        /* retransmissions before a WR fails */
+  const char *output;   /* CSV file the sweep test writes, NULL = none */
+  int clients;          /* clients the atomic test server waits for */
+  int slots;            /* remote 8 byte slots the atomic test spreads over */
+  int srq;              /* SRQ entries shared by the server QPs, 0 = none */
+  int transport;        /* IBV_QPT_RC or IBV_QPT_UD */
+  int connect;          /* enum conn_backend bits run by the connect test */
+  int qps;              /* RC QPs connected by qpscale and exchange */
+  int threads;          /* worker threads of bw and mtsetup, a QP each */
+  int cpus[SWEEP_MAX];  /* core of every worker thread, see --cpus */
+  int num_cpus;         /* entries in cpus, 0 = thread i on core i */
+  const char *record;   /* binary file every LOG_TIME sample goes to */
+  int counters;         /* snapshot port and CPU counters around phases */
+};
+
+/* values of every dimension of the sweep test, set with --sizes, --mtus,
+ * --opcodes and --rd-atomics, a dimension left empty takes the config value */
+struct sweep_spec {
+  size_t sizes[SWEEP_MAX];
+  int num_sizes;
+  int mtus[SWEEP_MAX]; /* enum ibv_mtu */
+  int num_mtus;
+  int opcodes[SWEEP_MAX];
+  int num_opcodes;
+  int rd_atomics[SWEEP_MAX];
+  int num_rd_atomics;
+};
+
+/* sweep test control message, the client sends one before every point and
+ * the server answers with its own, all fields in network byte order */
+enum sweep_cmd {
+  SWEEP_BEGIN = 0, /* size is the largest size, qdepth the window */
+  SWEEP_POINT,     /* run the point described by the other fields */
+  SWEEP_END        /* no more points */
+};
+struct sweep_ctrl {
+  uint32_t cmd;    /* enum sweep_cmd */
+  uint32_t opcode; /* IBV_WR_* */
+  uint32_t mtu;    /* enum ibv_mtu */
+  uint32_t rd_atomic;
+  uint32_t qdepth;
+  uint32_t ok;     /* the sender can run the point */
+  uint64_t size;   /* message size */
+} __attribute__((packed));
+
+/* parameters of one run of the bandwidth engine */
+struct bw_params {
+  int opcode;   /* IBV_WR_SEND, IBV_WR_RDMA_WRITE or IBV_WR_RDMA_READ */
+  int qdepth;   /* max WRs outstanding at any time */
+  int batch;    /* WRs chained into one ibv_post_send (one doorbell) */
+  int signal;   /* only every signal-th WR (and the last) is signaled */
+  size_t size;  /* message size */
+  int frags;    /* message gathered from frags fragments of frag_size */
+  size_t frag_size;
+  int pack;     /* memcpy the fragments into one buffer instead of SGEs */
+  size_t iters; /* number of messages */
+};
+
+/* outcome of one run of the bandwidth engine */
+struct bw_result {
+  size_t msgs;  /* completed messages */
+  size_t bytes; /* completed payload bytes */
+  uint64_t ns;  /* from the first post to the last completion */
+  uint64_t cycles;      /* CPU cycles over the same interval */
+  uint64_t post_cycles; /* CPU cycles spent inside ibv_post_send */
+  size_t posts;         /* ibv_post_send calls */
+  uint64_t poll_cycles; /* cycles in ibv_poll_cq calls that reaped CQEs */
+  size_t polls;         /* ibv_poll_cq calls which returned completions */
+  size_t empty_polls;   /* ibv_poll_cq calls which returned nothing */
+  size_t cqes;          /* completions reaped */
+};
+
+/* outcome of one run of run_atomic */
+struct atomic_result {
+  size_t ops;       /* atomics completed */
+  size_t swaps;     /* compare-and-swaps which found the expected value */
+  uint64_t ns;      /* wall time from the first post to the last completion */
+};
+
+/* completion polling state, see cq_poller_poll */
+struct cq_poller {
+  struct ibv_cq *cq;       /* CQ to poll */
+  struct ibv_wc *wc;       /* completions of the last poll */
+  int batch;               /* max completions drained per ibv_poll_cq */
+  uint64_t timeout_cycles; /* give up after this many cycles without CQEs */
+  int mode;                /* enum cq_mode */
+  uint64_t spin_cycles;    /* cycles spun before sleeping in hybrid mode */
+  struct ibv_comp_channel *channel; /* where CQ events arrive */
+  int epfd;                /* epoll instance watching channel */
+  /* called every POLL_CQ_TIMEOUT_CHECK empty polls in busy mode, a positive
+   * return counts as progress and restarts the timeout, a negative one fails
+   * the poll */
+  int (*idle)(void *arg);
+  void *idle_arg;
+  void (*handler[WRID_KIND_NUM])(struct ibv_wc *wc, void *arg);
+  void *arg[WRID_KIND_NUM];
+  size_t polls;            /* ibv_poll_cq calls which returned completions */
+  size_t empty_polls;      /* ibv_poll_cq calls which returned nothing */
+  size_t cqes;             /* completions reaped */
+  size_t sleeps;           /* CQ events waited for */
+  uint64_t poll_cycles;    /* cycles in the polls counted by polls */
 };
 /* structure to exchange data which is needed to connect the QPs */
 struct cm_con_data_t {
@@ -134,6 +649,45 @@ struct cm_con_data_t {
   uint8_t gid[16]; /* gid */
 } __attribute__((packed));
 
+/* prefix of a batch of records sent by sock_exchange, network order */
+struct batch_hdr {
+  uint32_t count;    /* records following */
+  uint32_t rec_size; /* bytes per record */
+} __attribute__((packed));
+
+/* a registered range kept by the registration cache */
+struct reg_cache_entry {
+  char *addr;                    /* start of the registered range */
+  size_t length;                 /* length of the registered range */
+  struct ibv_mr *mr;             /* MR covering the range */
+  int refcnt;                    /* users holding the MR, 0 = evictable */
+  struct reg_cache_entry *prev;  /* more recently used entry */
+  struct reg_cache_entry *next;  /* less recently used entry */
+};
+
+/* pin-down cache of memory registrations, looked up by address range */
+struct reg_cache {
+  struct ibv_pd *pd;             /* PD the cached MRs belong to */
+  size_t budget;                 /* max bytes kept pinned by idle entries */
+  size_t pinned;                 /* bytes currently registered */
+  struct reg_cache_entry *head;  /* most recently used entry */
+  struct reg_cache_entry *tail;  /* least recently used entry */
+  size_t hits;                   /* lookups covered by an existing MR */
+  size_t misses;                 /* lookups which had to call ibv_reg_mr */
+  size_t evictions;              /* entries dropped to stay in budget */
+  size_t invalidations;          /* entries dropped because buffer was freed */
+  uint64_t hit_ns;               /* total lookup time of hits */
+  uint64_t miss_ns;              /* total lookup time of misses */
+};
+
+/* QPs created ahead of time and kept in INIT, ready to be connected */
+struct qp_pool {
+  struct ibv_qp **qps; /* idle QPs, all in INIT */
+  int size;            /* capacity of qps */
+  int count;           /* number of idle QPs */
+  size_t created;      /* QPs created because the pool was empty */
+};
+
 /* structure of system resources */
 struct resources {
   struct ibv_device_attr device_attr;
@@ -143,13 +697,47 @@ struct resources {
   struct ibv_context *ib_ctx;        /* device handle */
   struct ibv_pd *pd;                 /* PD handle */
   struct ibv_cq *cq;                 /* CQ handle */
+  struct ibv_comp_channel *channel;  /* CQ events, event/hybrid mode only */
+  int epfd;                          /* epoll instance watching channel */
   struct ibv_qp *qp;                 /* QP handle */
+  struct ibv_srq *srq;               /* SRQ the QP receives from, or NULL */
+  struct ibv_ah *ah;                 /* address of the peer, UD only */
   struct ibv_mr *mr;                 /* MR handle for buf */
   char *buf; /* memory buffer pointer, used for RDMA and send
 ops */
+  size_t buf_size; /* size of buf, MSG_SIZE unless a test asks for more */
+  uint32_t max_inline; /* max_inline_data granted to the QP */
+  uint32_t max_send_sge; /* max_send_sge granted to the QP */
+  char *inline_buf; /* unregistered source of inline sends, NULL = use buf */
   int sock;  /* TCP socket file descriptor */
+  size_t level_time[RES_LEVEL_NUM]; /* create + destroy time per level (ns) */
+  /* create + destroy CPU counters per level, with --counters */
+  uint64_t level_cpu[RES_LEVEL_NUM][CPU_COUNTER_NUM];
+};
+
+/* one worker of the multi-threaded bw test: its own CQ, MR and QP on the
+ * device context and PD of the main resources */
+struct bw_thread {
+  pthread_t thread;
+  int index;
+  int cpu;                  /* core the thread is pinned to, -1 = none */
+  struct resources res;
+  const struct bw_params *params;
+  struct bw_result result;
+  uint64_t start_ns;        /* run of the engine, get_time_ns */
+  uint64_t end_ns;
+  int rc;
 };
 
+/* one worker of the mtsetup test: creates, connects and destroys its CQ,
+ * MR and QP over its own TCP socket, on the shared context and PD */
+struct setup_thread {
+  pthread_t thread;
+  int cpu;                  /* core the thread is pinned to, -1 = none */
+  struct resources res;
+  struct verb_sink sink;    /* the thread's LOG_TIME samples */
+  int rc;
+};
 
 
 /******************************************************************************
@@ -180,6 +768,24 @@ this example
  ******************************************************************************/
 static int sock_connect(const char *servername, int port);
 
+/******************************************************************************
+ * Function: sock_listen
+ *
+ * Input
+ * port port of service
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * listening socket (fd) on success, -1 on failure
+ *
+ * Description
+ * Bind a listening socket to port, with SO_REUSEADDR so that it can be
+ * bound again while connections accepted from an earlier one are open.
+ ******************************************************************************/
+static int sock_listen(int port);
+
 /******************************************************************************
  * Function: sock_sync_data
  *
@@ -192,11 +798,12 @@ static int sock_connect(const char *servername, int port);
  * remote_data pointer to buffer to receive remote data
  *
  * Returns
- * 0 on success, negative error code on failure
+ * 0 on success, 1 on failure
  *
  * Description
  * Sync data across a socket. The indicated local data will be sent to the
- * remote. It will then wait for the remote to send its data back. It is
+ * remote while the remote's data is read, so that neither side blocks on a
+ * full socket buffer; partial writes and reads are continued. It is
  * assumed that the two sides are in sync and call this function in the proper
  * order. Chaos will ensue if they are not. :)
  *
@@ -207,6 +814,31 @@ static int sock_connect(const char *servername, int port);
 int sock_sync_data(int sock, int xfer_size, char *local_data,
                    char *remote_data);
 
+/******************************************************************************
+ * Function: sock_exchange
+ *
+ * Input
+ * sock socket to transfer data on
+ * local count records of rec_size bytes to send
+ * max_count largest number of records accepted from the peer
+ *
+ * Output
+ * remote records sent by the peer, allocated, to be freed by the caller
+ * remote_count number of records in remote
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Swaps a length-prefixed batch of records with the peer in one pipelined
+ * transfer: a batch_hdr followed by the records goes out while the peer's
+ * header and records are read, however many records either side sends. The
+ * peer has to use the same rec_size.
+ ******************************************************************************/
+static int sock_exchange(int sock, const void *local, uint32_t count,
+                         uint32_t rec_size, uint32_t max_count,
+                         void **remote, uint32_t *remote_count);
+
 /******************************************************************************
 End of socket operations
 ******************************************************************************/
@@ -230,6 +862,60 @@ End of socket operations
  ******************************************************************************/
 static int poll_completion(struct resources *res);
 
+/******************************************************************************
+ * Function: cq_poller_init / cq_poller_on / cq_poller_destroy
+ *
+ * Input
+ * poller polling state
+ * res resources whose CQ, completion channel and epoll instance are used
+ * (init)
+ * batch max completions drained per ibv_poll_cq (init)
+ * kind enum wrid_kind to dispatch (on)
+ * handler function called with every successful completion of kind and arg
+ * (on)
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * cq_poller_init: 0 on success, 1 on failure
+ *
+ * Description
+ * Set up, configure and release a completion polling engine. The engine
+ * waits the way config.cq_mode says, event and hybrid mode need the CQ to be
+ * created with a completion channel.
+ ******************************************************************************/
+static int cq_poller_init(struct cq_poller *poller, struct resources *res,
+                          int batch);
+static void cq_poller_on(struct cq_poller *poller, int kind,
+                         void (*handler)(struct ibv_wc *wc, void *arg),
+                         void *arg);
+static void cq_poller_destroy(struct cq_poller *poller);
+
+/******************************************************************************
+ * Function: cq_poller_poll
+ *
+ * Input
+ * poller polling state
+ *
+ * Output
+ * poller->wc holds the completions reaped
+ *
+ * Returns
+ * number of completions on success, -1 on failure, bad completion or timeout
+ *
+ * Description
+ * Wait until ibv_poll_cq returns completions, draining up to poller->batch
+ * at once, and hand every one of them to the handler registered for its
+ * wr_id kind. Busy mode spins and checks the timeout only every
+ * POLL_CQ_TIMEOUT_CHECK empty polls, against the cycle counter, so that no
+ * clock read sits in the hot loop. Event mode arms the CQ with
+ * ibv_req_notify_cq, polls once more to catch completions which raced the
+ * arming, and sleeps in epoll_wait on the channel fd. Hybrid mode spins for
+ * poller->spin_cycles before doing the same.
+ ******************************************************************************/
+static int cq_poller_poll(struct cq_poller *poller);
+
 /******************************************************************************
  * Function: post_send
  *
@@ -265,6 +951,126 @@ static int post_send(struct resources *res, int opcode);
  ******************************************************************************/
 static int post_receive(struct resources *res);
 
+/******************************************************************************
+ * Function: buffer_alloc / buffer_free
+ *
+ * Input
+ * size size of the buffer in bytes
+ * buf buffer returned by buffer_alloc (buffer_free only)
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * buffer_alloc: buffer on success, NULL on failure
+ *
+ * Description
+ * Allocate and free the data buffers which get registered, with the
+ * allocator and prefault policy of config.alloc and config.prefault.
+ * Allocation and prefault are logged separately as buf_alloc and buf_touch.
+ * Freeing a buffer invalidates its registrations in the registration cache.
+ ******************************************************************************/
+static char *buffer_alloc(size_t size);
+static char *buffer_alloc_thp(size_t length);
+static void buffer_free(char *buf, size_t size);
+
+/******************************************************************************
+ * Function: reg_cache_init
+ *
+ * Input
+ * cache registration cache to initialize
+ * pd protection domain to register memory with
+ * budget max bytes kept pinned by idle (unreferenced) registrations
+ *
+ * Output
+ * cache is initialized and empty
+ *
+ * Returns
+ * none
+ ******************************************************************************/
+static void reg_cache_init(struct reg_cache *cache, struct ibv_pd *pd,
+                           size_t budget);
+
+/******************************************************************************
+ * Function: reg_cache_get
+ *
+ * Input
+ * cache registration cache
+ * addr start of the range to be registered
+ * length length of the range
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * MR covering [addr, addr + length) on success, NULL on failure
+ *
+ * Description
+ * Return a cached MR if one covers the requested range (hit), otherwise
+ * register the range (miss). Least recently used idle entries are evicted
+ * until the new registration fits in the budget. The returned MR is
+ * referenced until reg_cache_put is called.
+ ******************************************************************************/
+static struct ibv_mr *reg_cache_get(struct reg_cache *cache, char *addr,
+                                    size_t length);
+
+/******************************************************************************
+ * Function: reg_cache_put
+ *
+ * Input
+ * cache registration cache
+ * mr MR returned by reg_cache_get
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Drop a reference. The registration stays cached until it is evicted or
+ * its buffer is freed.
+ ******************************************************************************/
+static void reg_cache_put(struct reg_cache *cache, struct ibv_mr *mr);
+
+/******************************************************************************
+ * Function: reg_cache_invalidate
+ *
+ * Input
+ * cache registration cache
+ * addr start of the range which is going away
+ * length length of the range
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Deregister every cached entry overlapping the range. Must be called before
+ * the memory is given back to the system.
+ ******************************************************************************/
+static void reg_cache_invalidate(struct reg_cache *cache, char *addr,
+                                 size_t length);
+
+/******************************************************************************
+ * Function: reg_cache_flush
+ *
+ * Input
+ * cache registration cache
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Deregister all entries, e.g. before the PD is deallocated
+ ******************************************************************************/
+static void reg_cache_flush(struct reg_cache *cache);
+
 /******************************************************************************
  * Function: resources_init
  *
@@ -297,96 +1103,775 @@ static void resources_init(struct resources *res);
  * Description
  *
  * This function creates and allocates all necessary system resources. These
- * are stored in res.
+ * are stored in res. Levels which are still alive from a previous iteration
+ * (see resources_release) are kept as they are, only the missing ones are
+ * created. The time spent on every level is accumulated in res->level_time,
+ * with --counters the CPU counters in res->level_cpu.
  *****************************************************************************/
 static int sock_create(struct resources *res);
 static int resources_create(struct resources *res);
 
 /******************************************************************************
- * Function: modify_qp_to_init
+ * Function: counters_init
  *
  * Input
- * qp QP to transition
+ * none
  *
  * Output
  * none
  *
  * Returns
- * 0 on success, ibv_modify_qp failure code on failure
+ * 0 on success, 1 when neither port nor CPU counters are available
  *
  * Description
- * Transition a QP from the RESET to INIT state
+ * Open every file under /sys/class/infiniband/<dev>/ports/<port>/counters
+ * and hw_counters of the device the test uses (-d, or the first one) and a
+ * perf_event counter for cycles, instructions, page faults and dTLB misses
+ * of this process and the threads it creates later. Kernel time is counted
+ * when perf_event_paranoid allows it, so page pinning and IOMMU mapping of
+ * ibv_reg_mr show up. Unavailable counters are skipped
  ******************************************************************************/
-static int modify_qp_to_init(struct ibv_qp *qp);
+static int counters_init(void);
 
 /******************************************************************************
- * Function: modify_qp_to_rtr
+ * Function: counters_close
  *
  * Input
- * qp QP to transition
- * remote_qpn remote QP number
- * dlid destination LID
- * dgid destination GID (mandatory for RoCEE)
+ * none
  *
  * Output
  * none
  *
  * Returns
- * 0 on success, ibv_modify_qp failure code on failure
+ * none
  *
  * Description
- * Transition a QP from the INIT to RTR state, using the specified QP number
+ * Close the perf_event and sysfs descriptors opened by counters_init, does
+ * nothing when counters_init did not run
  ******************************************************************************/
-static int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn,
-                            uint16_t dlid, uint8_t *dgid);
+static void counters_close(void);
 
 /******************************************************************************
- * Function: modify_qp_to_rts
+ * Function: counters_snap / counters_cpu
  *
  * Input
- * qp QP to transition
+ * snap, cpu where to store the values
  *
  * Output
- * none
+ * the current port and CPU counters, or only the CPU counters
  *
  * Returns
- * 0 on success, ibv_modify_qp failure code on failure
+ * none
  *
  * Description
- * Transition a QP from the RTR to RTS state
+ * counters_cpu costs one read(2) per CPU counter and is cheap enough per
+ * resource level; counters_snap also rereads every sysfs file
  ******************************************************************************/
-static int modify_qp_to_rts(struct ibv_qp *qp);
+static void counters_snap(struct counter_snap *snap);
+static void counters_cpu(uint64_t *cpu);
 
 /******************************************************************************
- * Function: connect_qp
+ * Function: counters_add
  *
  * Input
- * res pointer to resources structure
+ * sum accumulated delta
+ * begin, end snapshots around a phase
+ *
+ * Output
+ * sum increased by end - begin
+ *
+ * Returns
+ * none
+ ******************************************************************************/
+static void counters_add(struct counter_snap *sum,
+                         const struct counter_snap *begin,
+                         const struct counter_snap *end);
+
+/******************************************************************************
+ * Function: report_counters
+ *
+ * Input
+ * tag test name printed in the result line
+ * phase name of the phase
+ * delta counter deltas of the phase
+ * div iterations delta covers, the printed values are per iteration
  *
  * Output
  * none
  *
  * Returns
- * 0 on success, error code on failure
+ * none
  *
  * Description
- * Connect the QP. Transition the server side to RTR, sender side to RTS
+ * Print the CPU counters and every port counter that changed
  ******************************************************************************/
-static int connect_qp(struct resources *res);
- 
+static void report_counters(const char *tag, const char *phase,
+                            const struct counter_snap *delta, size_t div);
+
 /******************************************************************************
- * Function: resources_destroy
+ * Function: resources_create_device / _pd / _cq / _mr / _qp
  *
  * Input
  * res pointer to resources structure
  *
  * Output
- * none
+ * the handle(s) of one resource level are filled in
  *
  * Returns
  * 0 on success, 1 on failure
  *
  * Description
- * Cleanup and deallocate all resources used
+ * Create a single resource level. The levels above it must already exist.
  ******************************************************************************/
-static int resources_destroy(struct resources *res);
+static int resources_create_device(struct resources *res);
+static int resources_create_pd(struct resources *res);
+static int resources_create_cq(struct resources *res);
+static int resources_create_mr(struct resources *res);
+static int resources_create_qp(struct resources *res);
+
+/******************************************************************************
+ * Function: create_qp
+ *
+ * Input
+ * res pointer to resources structure, pd and cq must exist
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * new QP in RESET on success, NULL on failure
+ *
+ * Description
+ * Create a QP with the attributes used by every test
+ ******************************************************************************/
+static struct ibv_qp *create_qp(struct resources *res);
+
+/******************************************************************************
+ * Function: qp_pool_create
+ *
+ * Input
+ * pool QP pool to fill
+ * res pointer to resources structure, pd and cq must exist
+ * size number of QPs to create ahead of time
+ *
+ * Output
+ * pool holds size QPs in INIT
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ ******************************************************************************/
+static int qp_pool_create(struct qp_pool *pool, struct resources *res,
+                          int size);
+
+/******************************************************************************
+ * Function: qp_pool_get
+ *
+ * Input
+ * pool QP pool
+ * res pointer to resources structure the pool was created with
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * QP in INIT on success, NULL on failure
+ *
+ * Description
+ * Hand out an idle QP. If the pool is empty a new QP is created and moved to
+ * INIT, so the caller never has to fall back on its own.
+ ******************************************************************************/
+static struct ibv_qp *qp_pool_get(struct qp_pool *pool,
+                                  struct resources *res);
+
+/******************************************************************************
+ * Function: qp_pool_put
+ *
+ * Input
+ * pool QP pool
+ * qp QP returned by qp_pool_get, in any state
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Recycle the QP through RESET back to INIT instead of destroying it. The QP
+ * is only destroyed when the pool is already full.
+ ******************************************************************************/
+static int qp_pool_put(struct qp_pool *pool, struct ibv_qp *qp);
+
+/******************************************************************************
+ * Function: qp_pool_destroy
+ *
+ * Input
+ * pool QP pool
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Destroy all idle QPs and the pool itself
+ ******************************************************************************/
+static int qp_pool_destroy(struct qp_pool *pool);
+
+/******************************************************************************
+ * Function: resources_destroy_device / _pd / _cq / _mr / _qp
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * the handle(s) of one resource level are released and set to NULL
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Destroy a single resource level. The levels below it must already be gone.
+ ******************************************************************************/
+static int resources_destroy_device(struct resources *res);
+static int resources_destroy_pd(struct resources *res);
+static int resources_destroy_cq(struct resources *res);
+static int resources_destroy_mr(struct resources *res);
+static int resources_destroy_qp(struct resources *res);
+
+/******************************************************************************
+ * Function: resources_release
+ *
+ * Input
+ * res pointer to resources structure
+ * keep deepest enum res_level to keep alive
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Destroy every resource level below keep, from the shortest-lived one up.
+ * When the QP itself is kept it is moved back to RESET, so that connect_qp
+ * can drive it through INIT/RTR/RTS again.
+ ******************************************************************************/
+static int resources_release(struct resources *res, int keep);
+
+/******************************************************************************
+ * Function: parse_res_level
+ *
+ * Input
+ * name one of "none", "device", "pd", "cq", "mr", "qp"
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * enum res_level on success, -1 on unknown name
+ ******************************************************************************/
+static int parse_res_level(const char *name);
+
+/******************************************************************************
+ * Function: modify_qp_to_init
+ *
+ * Input
+ * qp QP to transition
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, ibv_modify_qp failure code on failure
+ *
+ * Description
+ * Transition a QP from the RESET to INIT state
+ ******************************************************************************/
+static int modify_qp_to_init(struct ibv_qp *qp);
+
+/******************************************************************************
+ * Function: modify_qp_to_rtr
+ *
+ * Input
+ * qp QP to transition
+ * remote_qpn remote QP number
+ * dlid destination LID
+ * dgid destination GID (mandatory for RoCEE)
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, ibv_modify_qp failure code on failure
+ *
+ * Description
+ * Transition a QP from the INIT to RTR state, using the specified QP number
+ ******************************************************************************/
+static int modify_qp_to_rtr(struct ibv_qp *qp, uint32_t remote_qpn,
+                            uint16_t dlid, uint8_t *dgid);
+
+/******************************************************************************
+ * Function: modify_qp_to_rts
+ *
+ * Input
+ * qp QP to transition
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, ibv_modify_qp failure code on failure
+ *
+ * Description
+ * Transition a QP from the RTR to RTS state
+ ******************************************************************************/
+static int modify_qp_to_rts(struct ibv_qp *qp);
+
+/******************************************************************************
+ * Function: modify_qp_to_reset
+ *
+ * Input
+ * qp QP to transition
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, ibv_modify_qp failure code on failure
+ *
+ * Description
+ * Transition a QP from any state back to RESET, flushing its work queues
+ ******************************************************************************/
+static int modify_qp_to_reset(struct ibv_qp *qp);
+
+
+/******************************************************************************
+ * Function: connect_qp
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, error code on failure
+ *
+ * Description
+ * Connect the QP. Transition the server side to RTR, sender side to RTS
+ ******************************************************************************/
+static int connect_qp(struct resources *res);
+
+/******************************************************************************
+ * Function: reconnect_qp
+ *
+ * Input
+ * res pointer to resources structure, QP connected by connect_qp before
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Take the connected QP through RESET, INIT, RTR and RTS again with the
+ * current config (MTU, rd_atomic, timeout, retry count) and the remote side
+ * saved by connect_qp, then sync with the peer which does the same. Posted
+ * receives are flushed.
+ ******************************************************************************/
+static int reconnect_qp(struct resources *res);
+ 
+/******************************************************************************
+ * Function: resources_destroy
+ *
+ * Input
+ * res pointer to resources structure
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Cleanup and deallocate all resources used, same as
+ * resources_release(res, RES_LEVEL_NONE)
+ ******************************************************************************/
+static int resources_destroy(struct resources *res);
+
+/******************************************************************************
+ * Function: run_bw_send
+ *
+ * Input
+ * res pointer to resources structure with a connected QP
+ * params what to send and how many WRs to keep outstanding
+ *
+ * Output
+ * result filled in with the completed messages, bytes and time
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Post params->iters messages, keeping up to params->qdepth WRs in flight
+ * and reposting as completions come back. WRs are posted as linked lists of
+ * params->batch WRs, ringing the doorbell once per list. Only every
+ * params->signal-th WR is signaled; since send completions arrive in order,
+ * its completion retires all the unsignaled WRs before it as well, and the
+ * send queue occupancy (posted - completed) never exceeds params->qdepth.
+ ******************************************************************************/
+static int run_bw_send(struct resources *res, const struct bw_params *params,
+                       struct bw_result *result);
+
+/******************************************************************************
+ * Function: run_bw_recv
+ *
+ * Input
+ * res pointer to resources structure with a connected QP
+ * params same parameters as the sending side
+ *
+ * Output
+ * result filled in with the received messages, bytes and time
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Receiving side of IBV_WR_SEND. The first params->qdepth receives must
+ * have been posted with bw_post_recvs before the sender starts, every
+ * completed receive is reposted until params->iters are consumed.
+ ******************************************************************************/
+static int run_bw_recv(struct resources *res, const struct bw_params *params,
+                       struct bw_result *result);
+static int bw_post_recvs(struct resources *res, size_t size, int num);
+
+/******************************************************************************
+ * Function: run_lat
+ *
+ * Input
+ * res pointer to resources structure with a connected QP, buf holds a
+ * receive half followed by a send half of size bytes each
+ * opcode IBV_WR_RDMA_WRITE or IBV_WR_SEND
+ * size message size
+ * iters number of round trips
+ *
+ * Output
+ * samples round trip time of every iteration in nsec (initiator only)
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Ping-pong between the initiator (client) and the server. With RDMA WRITE
+ * each side writes its send half into the peer's receive half and detects
+ * the peer's message by spinning on the last byte of its own receive half,
+ * which carries the iteration's sequence number; no CQ is involved in the
+ * receive path, the sender only polls its own send completion. With SEND the
+ * arrival is detected through the receive completion instead.
+ ******************************************************************************/
+static int run_lat(struct resources *res, int opcode, size_t size,
+                   size_t iters, uint64_t *samples);
+
+/******************************************************************************
+ * Function: report_bw
+ *
+ * Input
+ * tag test name printed in the result line
+ * params parameters of the run
+ * result outcome of the run
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Print bandwidth in GB/s and message rate in Mmsg/s
+ ******************************************************************************/
+static void report_bw(const char *tag, const struct bw_params *params,
+                      const struct bw_result *result);
+
+/******************************************************************************
+ * Function: report_latency
+ *
+ * Input
+ * tag test name printed in the result line
+ * name what the samples measure
+ * samples latency samples in nanoseconds, sorted in place
+ * n number of samples
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Print min, average, p50, p99, p99.9 and max of the samples in usec
+ ******************************************************************************/
+static void report_latency(const char *tag, const char *name,
+                           uint64_t *samples, size_t n);
+
+/******************************************************************************
+ * Function: record_open
+ *
+ * Input
+ * path record file to create
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Create the record file, write its header and register record_close with
+ * atexit. From then on LOG_TIME appends every sample as a struct record:
+ * each thread fills its own record_buf and hands a full buffer to one
+ * write(2) on the O_APPEND file, a thread's rest is written when it exits
+ ******************************************************************************/
+static int record_open(const char *path);
+
+/******************************************************************************
+ * Function: record_close
+ *
+ * Input
+ * none
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * atexit hook writing the calling thread's buffered records, appending the
+ * verb name table and storing its offset in the header
+ ******************************************************************************/
+static void record_close(void);
+#ifdef LOG_TO_FILE
+/******************************************************************************
+ * Function: hist_record
+ *
+ * Input
+ * name verb name, as passed to LOG_TIME
+ * size message size the verb ran at
+ * ns duration of the verb
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * Add one sample to the (name, size) histogram. The histograms live in a
+ * static table, so recording never allocates or does I/O; a sample of a new
+ * pair is dropped once HIST_MAX pairs exist
+ ******************************************************************************/
+
+/******************************************************************************
+ * Function: hist_dump
+ *
+ * Input
+ * none
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * none
+ *
+ * Description
+ * atexit hook printing one HIST line per (verb, size) histogram to stdout:
+ * count, mean, stddev, p50, p90, p99, p99.9 and max in ns followed by the
+ * non-empty buckets as index:count, so histograms of several processes can
+ * be merged by adding the buckets (see statistics.py)
+ ******************************************************************************/
+static void hist_dump(void);
+#endif
+
+/******************************************************************************
+ * Function: run_atomic
+ *
+ * Input
+ * res pointer to resources structure, QP connected
+ * opcode IBV_WR_ATOMIC_FETCH_AND_ADD or IBV_WR_ATOMIC_CMP_AND_SWP
+ * iters number of atomics
+ *
+ * Output
+ * samples latency of every atomic in nsec, iters entries
+ * result operations, successful swaps and time
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Keep config.qdepth atomics in flight on the remote slots, atomic i
+ * targeting slot i % config.slots ATOMIC_SLOT_STRIDE bytes apart. Fetch and
+ * add adds 1, compare and swap replaces the value last seen in the slot by
+ * its successor, so that the sum of all slots counts the increments which
+ * took effect in both cases. The fetched values land in res->buf.
+ ******************************************************************************/
+static int run_atomic(struct resources *res, int opcode, size_t iters,
+                      uint64_t *samples, struct atomic_result *result);
+
+/******************************************************************************
+ * Function: run_bw_threads
+ *
+ * Input
+ * res pointer to resources structure, sock connected
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Multi-threaded bw test. Opens the device and PD in res, then gives each of
+ * config.threads bw_thread workers its own CQ, MR and QP, connected one
+ * after the other over the TCP socket. Runs the bandwidth engine on 1, 2, 4
+ * .. config.threads workers at once, each pinned to its core, and prints
+ * every worker's result, the aggregate bandwidth and message rate, and the
+ * scaling efficiency against the single thread run.
+ ******************************************************************************/
+static int run_bw_threads(struct resources *res);
+
+/******************************************************************************
+ * Function: bw_setup / bw_run_point
+ *
+ * Input
+ * res pointer to resources structure
+ * params parameters of one measurement (bw_run_point)
+ * tag test name printed in the result line (bw_run_point)
+ *
+ * Output
+ * out result of the measurement unless NULL (bw_run_point)
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * bw_setup creates and connects the resources of the bandwidth style tests.
+ * bw_run_point runs one measurement with the peer in lockstep: the server
+ * posts receives for SEND, both sides sync, the client sends while the
+ * server receives (or waits for WRITE/READ) and both sides sync again.
+ ******************************************************************************/
+static int bw_setup(struct resources *res);
+static int bw_run_point(struct resources *res, const struct bw_params *params,
+                        const char *tag, struct bw_result *out);
+
+/******************************************************************************
+ * Function: run_setup_test / run_regcache_test / run_qppool_test /
+ * run_bw_test / run_lat_test / run_batch_test / run_sig_test /
+ * run_cqmode_test / run_inline_test / run_sge_test / run_sweep_test /
+ * run_atomic_test / run_srq_test / run_qpscale_test / run_mtsetup_test /
+ * run_transport_test / run_connect_test / run_exchange_test
+ *
+ * Input
+ * res pointer to resources structure, sock already connected if the test
+ * needs a peer
+ *
+ * Output
+ * none
+ *
+ * Returns
+ * 0 on success, 1 on failure
+ *
+ * Description
+ * Benchmarks selected with -t. Results are printed to stderr.
+ * setup: LOOP iterations of create, connect, send one message and release
+ * down to the --reuse level.
+ * regcache: LOOP lookups over reg_cache_ws buffers of MSG_SIZE picked at
+ * random, every 16th lookup frees and reallocates its buffer. Reports the hit
+ * rate and the latency of a hit versus a miss. Runs locally, without a peer.
+ * qppool: LOOP times bring a QP to RTS, once created from scratch and once
+ * acquired from a pool of qp_pool QPs, and compare the latencies of both
+ * paths and of destroy versus recycle. The QPs are connected to a local QP,
+ * so it runs without a peer.
+ * bw: connect once and push LOOP messages of MSG_SIZE with config.opcode,
+ * keeping config.qdepth WRs outstanding. The client is the initiator, the
+ * server only posts receives for SEND and waits otherwise. With
+ * config.threads above 1 run_bw_threads takes over.
+ * lat: connect once and run LOOP round trips of MSG_SIZE with run_lat,
+ * config.opcode being write (last byte polling) or send. The client prints
+ * min/avg/p50/p99/p99.9/max of the round trip time, both sides print the CPU
+ * time they consumed.
+ * batch: bandwidth test repeated with chains of 1, 2, 4 .. config.batch WRs
+ * per ibv_post_send, printing message rate and CPU cycles per message.
+ * sig: bandwidth test repeated with a completion requested every 1, 2, 4 ..
+ * qdepth WRs, printing message rate and the CQ polling cost per message.
+ * cqmode: latency test repeated with busy, event and hybrid completion
+ * handling on the same connection, printing latency and CPU time of each.
+ * inline: lat and bw tests for every power of two from 1 byte to
+ * INLINE_TEST_MAX, once posted normally and once with IBV_SEND_INLINE from an
+ * unregistered buffer as long as the size fits the inline size granted.
+ * sge: bandwidth test of messages made of 1, 2, 4 .. max_send_sge
+ * non-contiguous fragments of SGE_TEST_MIN_FRAG up to MSG_SIZE bytes, once
+ * gathered by the HCA from one SGE per fragment and once packed with memcpy
+ * into a bounce buffer posted as a single SGE.
+ * sweep: bandwidth test over every combination of the sweep_spec lists on a
+ * single connection. The client drives, announcing every point to the server
+ * with a sweep_ctrl message; a point is skipped when its MTU exceeds the
+ * active MTU of either side. The QP is reconnected whenever MTU or rd_atomic
+ * change. With config.output the client writes one CSV row per point.
+ * atomic: every client runs LOOP atomics of config.opcode (fadd or cas) with
+ * run_atomic against the server's slots and prints ops/s and latency
+ * percentiles. The server accepts config.clients clients, one CQ and QP
+ * each sharing its MR, starts them together and checks that its slots sum
+ * up to the increments the clients report.
+ * srq: every client runs the send latency test against the server, which
+ * accepts config.clients clients on one CQ and answers every message. With
+ * config.srq all QPs receive from one SRQ of that many entries, refilled in
+ * batches of SRQ_POST_BATCH once IBV_EVENT_SRQ_LIMIT_REACHED reports it low,
+ * otherwise every QP has qdepth receives of its own. The server prints the
+ * receive memory posted, VmPin and VmRSS.
+ * qpscale: grows the number of RC QPs between the two sides from 1 to
+ * config.qps, doubling each step. The new QPs of a step share the CQ and MR,
+ * their connection records are swapped in one sock_exchange and all
+ * of them are moved to RTS before one sync. Prints QPs connected per second
+ * and the VmRSS and VmPin growth per QP, then the client spreads LOOP WRITEs
+ * or READs round-robin over all QPs and prints the message rate.
+ * mtsetup: runs LOOP rounds of creating the CQ, MR and QP, connect_qp and
+ * destroying them again on 1, 2, 4 .. config.threads setup_thread workers at
+ * once, each with its own TCP connection, sharing the device context and PD.
+ * LOG_TIME samples go to a verb_sink per thread; per thread count the
+ * merged latency percentiles of every verb and the aggregate setups per
+ * second are printed.
+ * transport: the send latency and bandwidth tests, first over an RC QP,
+ * then over a UD QP with an address handle, and a line comparing median
+ * latency and message rate of both. config.transport selects the QP type of
+ * the lat and bw tests as well.
+ * connect: LOOP times creates an RC QP, connects it and tears it down again,
+ * once per backend in config.connect: the TCP exchange of connect_qp, and,
+ * when built with HAVE_RDMACM, rdma_resolve_addr, rdma_resolve_route and
+ * rdma_connect/rdma_accept driven by an rdma_cm event channel on the TCP
+ * port plus CM_PORT_OFFSET. Prints connect latency percentiles and
+ * connections per second per backend.
+ * exchange: for 1, 2, 4 .. config.qps RC QPs, the time to connect all of
+ * them one by one with connect_qp, two round trips each, and the time to
+ * connect them with one sock_exchange of all records and a single barrier.
+ ******************************************************************************/
+static int run_setup_test(struct resources *res);
+static int run_regcache_test(struct resources *res);
+static int run_qppool_test(struct resources *res);
+static int run_bw_test(struct resources *res);
+static int run_lat_test(struct resources *res);
+static int run_batch_test(struct resources *res);
+static int run_sig_test(struct resources *res);
+static int run_cqmode_test(struct resources *res);
+static int run_inline_test(struct resources *res);
+static int run_sge_test(struct resources *res);
+static int run_sweep_test(struct resources *res);
+static int run_atomic_test(struct resources *res);
+static int run_srq_test(struct resources *res);
+static int run_qpscale_test(struct resources *res);
+static int run_mtsetup_test(struct resources *res);
+static int run_transport_test(struct resources *res);
+static int run_connect_test(struct resources *res);
+static int run_exchange_test(struct resources *res);
@@ -3,32 +3,99 @@
 # Author: Hurray(zhuhongrui@{megvii.com,ncsg.ac.cn})
 # Date: 2020.09.15 11:30:25
 
-import os, sys
+import os, sys, struct
 from matplotlib import pyplot as plt
 from multiprocessing import Pool
 
 MAX_PROC = 8
-ibv_name_list = ["ibv_get_device_list", "ibv_open_device", "ibv_alloc_pd", "ibv_create_cq", "ibv_reg_mr", "ibv_create_qp", "ibv_modify_qp(init)", "ibv_post_recv", "ibv_modify_qp(rtr)", "ibv_modify_qp(rts)", "ibv_post_send", "ibv_poll_cq", "ibv_destroy_qp", "ibv_dereg_mr", "ibv_destroy_cq", "ibv_dealloc_pd", "ibv_close_device"]
+ibv_name_list = ["ibv_get_device_list", "ibv_open_device", "ibv_alloc_pd", "ibv_create_cq", "buf_alloc", "buf_touch", "ibv_reg_mr", "ibv_create_qp", "ibv_modify_qp(init)", "ibv_post_recv", "ibv_modify_qp(rtr)", "ibv_modify_qp(rts)", "ibv_post_send", "ibv_poll_cq", "ibv_modify_qp(reset)", "ibv_destroy_qp", "ibv_dereg_mr", "ibv_destroy_cq", "ibv_dealloc_pd", "ibv_close_device"]
 first_file = True
 
 def DEBUG(msg: str):
     print(msg)
 
+class Hist:
+    "log-linear histogram matching struct hist in rdma_perf.h, values in nsecond"
+    def __init__(self, sub_bits: int=5):
+        self.sub_bits = sub_bits
+        self.count = 0
+        self.sum = 0
+        self.buckets = {} # bucket index -> count
+
+    def bucket(self, v: int) -> int:
+        if v < (2 << self.sub_bits): return v
+        shift = v.bit_length() - 1 - self.sub_bits
+        return ((shift + 1) << self.sub_bits) + (v >> shift) - (1 << self.sub_bits)
+
+    def value(self, idx: int) -> float:
+        "midpoint of the values falling into bucket idx"
+        shift = (idx >> self.sub_bits) - 1
+        if shift <= 0: return idx
+        low = ((1 << self.sub_bits) + (idx & ((1 << self.sub_bits) - 1))) << shift
+        return low + ((1 << shift) - 1) / 2.0
+
+    def add(self, v: int):
+        self.count += 1
+        self.sum += v
+        b = self.bucket(v)
+        self.buckets[b] = self.buckets.get(b, 0) + 1
+
+    def merge(self, other: 'Hist'):
+        "add another process' (or thread's) histogram of the same verb and size"
+        self.count += other.count
+        self.sum += other.sum
+        for b, c in other.buckets.items():
+            self.buckets[b] = self.buckets.get(b, 0) + c
+
+    def mean(self) -> float:
+        return self.sum * 1.0 / self.count
+
+    def percentile(self, p: float) -> float:
+        rank = int(p * self.count)
+        seen = 0
+        for i in sorted(self.buckets):
+            seen += self.buckets[i]
+            if seen > rank: return self.value(i)
+        return 0.0
+
+    def values(self) -> tuple:
+        "(bucket values, counts), for plt.hist weights"
+        idx = sorted(self.buckets)
+        return [self.value(i) for i in idx], [self.buckets[i] for i in idx]
+
+def _parse_hist(t: list) -> Hist:
+    "HIST <name> <size> COUNT n SUM s ... SUB_BITS b BUCKETS idx:count ..."
+    kv = t.index("BUCKETS")
+    fields = dict(zip(t[3:kv:2], t[4:kv:2]))
+    h = Hist(int(fields["SUB_BITS"]))
+    h.count = int(fields["COUNT"])
+    h.sum = int(fields["SUM"])
+    for item in t[kv + 1:]:
+        b, c = item.split(':')
+        h.buckets[int(b)] = int(c)
+    return h
+
 def _handle_file(filename: str) -> dict:
-    global first_file
-    global ibv_name_list
     data = {}
     with open(filename, 'r') as f:
-        for line in f.readlines():
-            # format analysis
-            if line[0:4] != "ibv_": continue
-            t = line.split(' ')
-            ibv_name = t[0]
-            ibv_time = int(t[1]) # usecond
-
-            # insert to data
-            data.setdefault(ibv_name, [])
-            data[ibv_name].append(ibv_time)
+        for line in f:
+            t = line.split()
+            if not t: continue
+            # histogram dumped at exit by rdma_perf_log
+            if t[0] == "HIST":
+                data.setdefault(t[1], Hist()).merge(_parse_hist(t))
+                continue
+            # one "<verb> <nsecond>" line per sample, older logs
+            if line[0:4] != "ibv_" and line[0:4] != "buf_": continue
+            data.setdefault(t[0], Hist()).add(int(t[1]))
+    return data
+
+def _merge_data(datas: list) -> dict:
+    "merge the per-verb histograms of several files of one size"
+    data = {}
+    for d in datas:
+        for ibv_name in d:
+            data.setdefault(ibv_name, Hist(d[ibv_name].sub_bits)).merge(d[ibv_name])
     return data
 
 def _draw_data(data: dict, size: int, dirname: str):
@@ -39,10 +106,10 @@ def _draw_data(data: dict, size: int, dirname: str):
     # for every ibverb(every size), draw histgram
     for ibv_name in data:
         plt.figure(dpi=300)
-        time_list = data[ibv_name]
-        plt.hist(time_list, bins=50)
+        values, counts = data[ibv_name].values()
+        plt.hist(values, weights=counts, bins=50)
         plt.title("ibverb " + ibv_name + " latency distribution")
-        plt.xlabel("time: usecond")
+        plt.xlabel("time: nsecond")
         plt.ylabel("frequency")
         fname = "size-" + str(size) + "-" + ibv_name + ".png"
         fname = os.path.join(dirname, fname)
@@ -51,9 +118,7 @@ def _draw_data(data: dict, size: int, dirname: str):
         print("save: " + fname)
 
 def _do_summary(datas: list, dirname: str, uid: str):
-    "datas[size][ibv_name] = [value1 value2 value3 ...]"
-    def avg(d: list) -> float:
-        return sum(d) * 1.0 / len(d)
+    "datas[size][ibv_name] = Hist"
 
     def trans_bytes(byte: int) -> str:
         if byte < 1024: return "%dB" % byte
@@ -71,7 +136,7 @@ def _do_summary(datas: list, dirname: str, uid: str):
     for size in sizes:
         for ibv_name in datas[size]:
             logs.setdefault(ibv_name, [])
-            logs[ibv_name].append( avg(datas[size][ibv_name]) )
+            logs[ibv_name].append( datas[size][ibv_name].mean() )
 
     DEBUG(dirname)
     ibv_names = ibv_name_list
@@ -96,7 +161,7 @@ def _do_summary(datas: list, dirname: str, uid: str):
             # ibv_post_recv or ibv_post_send
             pass
     plt.legend(fontsize=8)
-    plt.ylabel('latency: uSecond')
+    plt.ylabel('latency: nSecond')
     plt.xlabel('packet size')
     plt.xticks(rotation=45)
     plt.title("ibverbs latency for different transfer size @ " + uid)
@@ -126,13 +191,23 @@ def _do_summary(datas: list, dirname: str, uid: str):
                 f.write("%.2f," % item)
             f.write("\n")
 
-def work(filename: str, size: int, dirname: str) -> dict:
-    # handle data
-    data = _handle_file(filename)
+def work(filenames: list, size: int, dirname: str) -> dict:
+    # handle data, several files of one size (processes) are merged
+    data = _merge_data([_handle_file(f) for f in filenames])
     # draw
     _draw_data(data, size, dirname + '_img')
     return data
 
+def _size_files(dname: str) -> dict:
+    "files[size] = [size-<size>.txt, size-<size>.<anything>.txt ...]"
+    files = {}
+    for f in os.listdir(dname):
+        if 'size-' not in f or ".txt" not in f: continue
+        DEBUG("handle: " + f)
+        size: int = int(f.split('-')[1].split('.')[0])
+        files.setdefault(size, []).append(os.path.join(dname, f))
+    return files
+
 def handle_log_folder(logdirname: str="./log/"):
     pool = Pool(processes=MAX_PROC)
     m_datas = {}
@@ -142,12 +217,8 @@ def handle_log_folder(logdirname: str="./log/"):
         if "_img" in d: continue
         datas = {}
         m_datas[dname] = datas
-        for f in os.listdir(dname):
-            if 'size-' not in f or ".txt" not in f: continue
-            DEBUG("handle: " + f)
-            size: int = int(f.split('-')[1].split('.')[0])
-            fname = os.path.join(dname, f)
-            datas[size] = pool.apply_async(work, (fname, size, dname))
+        for size, fnames in _size_files(dname).items():
+            datas[size] = pool.apply_async(work, (fnames, size, dname))
     pool.close()
     pool.join()
 
@@ -164,12 +235,8 @@ def handle_folder(foldername: str):
     pool = Pool(processes=MAX_PROC)
     datas = {}
     dname = os.path.join("./log/", foldername)
-    for f in os.listdir(dname):
-        if 'size-' not in f or ".txt" not in f: continue
-        DEBUG("handle: " + f)
-        size: int = int(f.split('-')[1].split('.')[0])
-        fname = os.path.join(dname, f)
-        datas[size] = pool.apply_async(work, (fname, size, dname))
+    for size, fnames in _size_files(dname).items():
+        datas[size] = pool.apply_async(work, (fnames, size, dname))
     pool.close()
     pool.join()
 
@@ -177,8 +244,87 @@ def handle_folder(foldername: str):
         datas[t] = datas[t].get()
     _do_summary(datas, dname + "_img", foldername)
 
+RECORD_MAGIC = b"RDMAPREC"
+RECORD_HDR = struct.Struct("<8sIIIIQ")
+RECORD_FIELD = struct.Struct("<12sHH")
+RECORD_CHUNK = 1 << 16 # records read at once
+
+def _record_format(fields: list, rec_size: int) -> tuple:
+    "struct format of one record built from the header's field table"
+    codes = {1: 'B', 2: 'H', 4: 'I', 8: 'Q'}
+    fmt, names, pos = "<", [], 0
+    for name, offset, size in sorted(fields, key=lambda f: f[1]):
+        fmt += "%dx" % (offset - pos) if offset > pos else ""
+        fmt += codes[size]
+        names.append(name)
+        pos = offset + size
+    fmt += "%dx" % (rec_size - pos) if rec_size > pos else ""
+    return struct.Struct(fmt), names
+
+def _handle_record(filename: str, datas: dict):
+    "stream a --record file of rdma_perf into datas[size][verb] = Hist"
+    with open(filename, 'rb') as f:
+        magic, version, hdr_size, rec_size, num_fields, names_offset = \
+            RECORD_HDR.unpack(f.read(RECORD_HDR.size))
+        if magic != RECORD_MAGIC:
+            raise ValueError(filename + ": not an rdma_perf record file")
+        fields = []
+        for _ in range(num_fields):
+            name, offset, size = RECORD_FIELD.unpack(f.read(RECORD_FIELD.size))
+            fields.append((name.rstrip(b'\0').decode(), offset, size))
+        rec, names = _record_format(fields, rec_size)
+        size_i, ns_i, verb_i = names.index("size"), names.index("ns"), names.index("verb")
+
+        # verb names, missing when the run did not exit cleanly
+        verbs = {}
+        end = names_offset
+        if names_offset:
+            f.seek(names_offset)
+            count, = struct.unpack("<I", f.read(4))
+            for i, name in enumerate(f.read().split(b'\0')[:count]):
+                verbs[i] = name.decode()
+        else:
+            end = os.fstat(f.fileno()).st_size
+        end -= (end - hdr_size) % rec_size
+
+        f.seek(hdr_size)
+        hists = {} # (size, verb id) -> Hist
+        left = end - hdr_size
+        while left > 0:
+            buf = f.read(min(left, RECORD_CHUNK * rec_size))
+            if not buf: break
+            left -= len(buf)
+            for r in rec.iter_unpack(buf):
+                key = (r[size_i], r[verb_i])
+                h = hists.get(key)
+                if h is None: h = hists[key] = Hist()
+                h.add(r[ns_i])
+    for (size, verb), h in hists.items():
+        name = verbs.get(verb, "verb%d" % verb)
+        datas.setdefault(size, {}).setdefault(name, Hist()).merge(h)
+
+def handle_record(filenames: list):
+    "summary of one or more record files, several processes are merged"
+    datas = {}
+    for f in filenames:
+        DEBUG("handle: " + f)
+        _handle_record(f, datas)
+    print("%-22s %10s %10s %12s %12s %12s %12s" %
+          ("verb", "size", "count", "mean(ns)", "p50(ns)", "p99(ns)", "p99.9(ns)"))
+    for size in sorted(datas):
+        for name, h in datas[size].items():
+            print("%-22s %10d %10d %12.1f %12.0f %12.0f %12.0f" %
+                  (name, size, h.count, h.mean(), h.percentile(0.5),
+                   h.percentile(0.99), h.percentile(0.999)))
+    dname = os.path.splitext(filenames[0])[0]
+    for size in datas:
+        _draw_data(datas[size], size, dname + '_img')
+    _do_summary(datas, dname + '_img', os.path.basename(dname))
+
 if __name__ == '__main__':
     if len(sys.argv) <= 1:
         handle_log_folder()
+    elif sys.argv[1] == "--record":
+        handle_record(sys.argv[2:])
     else:
         handle_folder(sys.argv[1])